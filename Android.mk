@@ -38,7 +38,10 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_SRC_FILES := \
 	autolock.cpp \
+	cpucompositor.cpp \
+	drmatomicrequest.cpp \
 	drmresources.cpp \
+	drmcommitgroup.cpp \
 	drmcomposition.cpp \
 	drmcompositor.cpp \
 	drmcompositorworker.cpp \
@@ -48,13 +51,20 @@ LOCAL_SRC_FILES := \
 	drmdisplaycompositor.cpp \
 	drmencoder.cpp \
 	drmeventlistener.cpp \
+	drmframebufferpool.cpp \
 	drmmode.cpp \
 	drmplane.cpp \
 	drmproperty.cpp \
+	drmtestcache.cpp \
+	executor.cpp \
+	framescheduler.cpp \
+	glcompositorservice.cpp \
 	glworker.cpp \
 	hwcomposer.cpp \
+	precompositor.cpp \
 	separate_rects.cpp \
 	virtualcompositorworker.cpp \
+	vsyncmodel.cpp \
 	vsyncworker.cpp \
 	worker.cpp
 
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_BOUNDED_QUEUE_H_
+#define ANDROID_BOUNDED_QUEUE_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <vector>
+
+namespace android {
+
+// A fixed size single-consumer ring buffer. Push() and Pop() are lock-free as
+// long as the queue has room, so handing an item to another thread costs a
+// couple of atomic operations rather than a round trip through its mutex.
+//
+// Producers that find the queue full sleep on a condition variable until the
+// consumer pops an item or their timeout expires. The consumer only touches
+// that condition variable when a producer is actually waiting.
+//
+// Queues with more than one producer thread serialize them with a mutex, which
+// is uncontended in practice; pass single_producer to Init() to skip it.
+//
+// Only the producer side blocks, consumers are expected to be woken some other
+// way (usually Worker::SignalIfIdle()) and to drain the queue with Pop().
+template <typename T>
+class BoundedQueue {
+ public:
+  BoundedQueue()
+      : capacity_(0),
+        single_producer_(false),
+        initialized_(false),
+        head_(0),
+        tail_(0),
+        producer_waiting_(false) {
+  }
+  ~BoundedQueue() {
+    if (!initialized_)
+      return;
+    pthread_cond_destroy(&not_full_);
+    pthread_mutex_destroy(&wait_lock_);
+    pthread_mutex_destroy(&producer_lock_);
+  }
+
+  BoundedQueue(const BoundedQueue &rhs) = delete;
+  BoundedQueue &operator=(const BoundedQueue &rhs) = delete;
+
+  int Init(size_t max_depth, bool single_producer = false) {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(&not_full_, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if (ret)
+      return -ret;
+
+    ret = pthread_mutex_init(&wait_lock_, NULL);
+    if (ret) {
+      pthread_cond_destroy(&not_full_);
+      return -ret;
+    }
+
+    ret = pthread_mutex_init(&producer_lock_, NULL);
+    if (ret) {
+      pthread_mutex_destroy(&wait_lock_);
+      pthread_cond_destroy(&not_full_);
+      return -ret;
+    }
+
+    capacity_ = std::max<size_t>(max_depth, 1);
+    slots_.resize(capacity_);
+    single_producer_ = single_producer;
+    initialized_ = true;
+    return 0;
+  }
+
+  // Appends |item|, waiting up to |timeout_ns| (forever if negative) for
+  // room. Returns -ETIMEDOUT if the queue stayed full, in which case |item| is
+  // left untouched and still belongs to the caller.
+  int Push(T &&item, int64_t timeout_ns) {
+    if (!single_producer_)
+      pthread_mutex_lock(&producer_lock_);
+
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    int ret = 0;
+    if (tail - head_.load(std::memory_order_acquire) >= capacity_)
+      ret = WaitForRoom(tail, timeout_ns);
+
+    if (!ret) {
+      slots_[tail % capacity_] = std::move(item);
+      // Sequentially consistent so that it is ordered before the consumer's
+      // idle check, see Worker::SignalIfIdle().
+      tail_.store(tail + 1);
+      stats_.pushed.fetch_add(1, std::memory_order_relaxed);
+      uint64_t depth = tail + 1 - head_.load(std::memory_order_relaxed);
+      if (depth > stats_.max_seen_depth.load(std::memory_order_relaxed))
+        stats_.max_seen_depth.store(depth, std::memory_order_relaxed);
+    }
+
+    if (!single_producer_)
+      pthread_mutex_unlock(&producer_lock_);
+    return ret;
+  }
+
+  // Moves the oldest item into |item|. Returns false if the queue is empty.
+  // Must only be called from the consumer thread.
+  bool Pop(T *item) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+
+    T &slot = slots_[head % capacity_];
+    *item = std::move(slot);
+    slot = T();
+    head_.store(head + 1);
+
+    if (producer_waiting_.load()) {
+      pthread_mutex_lock(&wait_lock_);
+      pthread_cond_signal(&not_full_);
+      pthread_mutex_unlock(&wait_lock_);
+    }
+    return true;
+  }
+
+  // Returns the oldest item without removing it, or NULL if the queue is
+  // empty. Must only be called from the consumer thread.
+  T *Front() {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return NULL;
+    return &slots_[head % capacity_];
+  }
+
+  // Drops everything in the queue. Must only be called from the consumer
+  // thread, or once the producers are gone.
+  void Clear() {
+    T item;
+    while (Pop(&item))
+      item = T();
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  size_t size() const {
+    uint64_t head = head_.load();
+    return tail_.load() - head;
+  }
+
+  size_t max_depth() const {
+    return capacity_;
+  }
+
+  void Dump(std::ostringstream *out) const {
+    uint64_t blocked = stats_.blocked.load(std::memory_order_relaxed);
+    uint64_t avg_wait_us =
+        blocked ? stats_.total_wait_ns.load(std::memory_order_relaxed) /
+                      blocked / 1000
+                : 0;
+    *out << "depth=" << size() << "/" << capacity_
+         << " max_seen=" << stats_.max_seen_depth.load()
+         << " pushed=" << stats_.pushed.load() << " blocked=" << blocked
+         << " timeouts=" << stats_.timeouts.load()
+         << " avg_wait_us=" << avg_wait_us
+         << " max_wait_us=" << stats_.max_wait_ns.load() / 1000;
+  }
+
+ private:
+  // Written by producers only, read by Dump().
+  struct Stats {
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> blocked{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> total_wait_ns{0};
+    std::atomic<uint64_t> max_wait_ns{0};
+    std::atomic<uint64_t> max_seen_depth{0};
+  };
+
+  static int64_t Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+  int WaitForRoom(uint64_t tail, int64_t timeout_ns) {
+    int64_t start_ns = Now();
+    struct timespec abs_deadline;
+    if (timeout_ns >= 0) {
+      int64_t deadline_ns = start_ns + timeout_ns;
+      abs_deadline.tv_sec = deadline_ns / 1000000000LL;
+      abs_deadline.tv_nsec = deadline_ns % 1000000000LL;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&wait_lock_);
+    // Pairs with the head_ store and producer_waiting_ load in Pop(): either
+    // we see the slot that was freed or the consumer sees us waiting.
+    producer_waiting_.store(true);
+    while (tail - head_.load() >= capacity_ && !ret) {
+      if (timeout_ns < 0)
+        ret = -pthread_cond_wait(&not_full_, &wait_lock_);
+      else
+        ret = -pthread_cond_timedwait(&not_full_, &wait_lock_, &abs_deadline);
+    }
+    producer_waiting_.store(false);
+    pthread_mutex_unlock(&wait_lock_);
+
+    uint64_t waited_ns = Now() - start_ns;
+    stats_.blocked.fetch_add(1, std::memory_order_relaxed);
+    stats_.total_wait_ns.fetch_add(waited_ns, std::memory_order_relaxed);
+    if (waited_ns > stats_.max_wait_ns.load(std::memory_order_relaxed))
+      stats_.max_wait_ns.store(waited_ns, std::memory_order_relaxed);
+    if (ret)
+      stats_.timeouts.fetch_add(1, std::memory_order_relaxed);
+    return ret;
+  }
+
+  std::vector<T> slots_;
+  size_t capacity_;
+  bool single_producer_;
+  bool initialized_;
+
+  // Index of the next item to pop, only written by the consumer.
+  std::atomic<uint64_t> head_;
+  // Keeps the two indices on separate cache lines so the producer and
+  // consumer don't keep stealing each other's line.
+  char padding_[64 - sizeof(std::atomic<uint64_t>)];
+  // Index of the next free slot, only written by producers.
+  std::atomic<uint64_t> tail_;
+
+  std::atomic<bool> producer_waiting_;
+  pthread_mutex_t wait_lock_;
+  pthread_cond_t not_full_;
+  pthread_mutex_t producer_lock_;
+
+  Stats stats_;
+};
+}
+
+#endif  // ANDROID_BOUNDED_QUEUE_H_
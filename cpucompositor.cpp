@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-cpu-compositor"
+
+#include "cpucompositor.h"
+#include "autolock.h"
+#include "drmdisplaycomposition.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <drm/drm_fourcc.h>
+#include <sync/sync.h>
+#include <ui/PixelFormat.h>
+#include <utils/Trace.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CPU_COMPOSITOR_NEON
+#endif
+
+namespace android {
+
+// The blending kernels work on four destination pixels at a time, with one
+// vector per color channel. Texels are fetched and unpacked to RGBA8888 (red
+// in the low byte) by scalar code, everything after that is vectorized.
+#if defined(__SSE2__)
+typedef __m128 vfloat;
+
+static inline vfloat VSplat(float f) {
+  return _mm_set1_ps(f);
+}
+static inline vfloat VAdd(vfloat a, vfloat b) {
+  return _mm_add_ps(a, b);
+}
+static inline vfloat VSub(vfloat a, vfloat b) {
+  return _mm_sub_ps(a, b);
+}
+static inline vfloat VMul(vfloat a, vfloat b) {
+  return _mm_mul_ps(a, b);
+}
+static inline vfloat VMax(vfloat a, vfloat b) {
+  return _mm_max_ps(a, b);
+}
+template <int shift>
+static inline vfloat VUnpack(const uint32_t *texels) {
+  __m128i v = _mm_loadu_si128((const __m128i *)texels);
+  v = _mm_and_si128(_mm_srli_epi32(v, shift), _mm_set1_epi32(0xff));
+  return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / 255.0f));
+}
+static inline __m128i VToByte(vfloat v) {
+  v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  v = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f));
+  return _mm_cvttps_epi32(v);
+}
+static inline void VPack(vfloat r, vfloat g, vfloat b, vfloat a,
+                         uint32_t *out) {
+  __m128i v = VToByte(r);
+  v = _mm_or_si128(v, _mm_slli_epi32(VToByte(g), 8));
+  v = _mm_or_si128(v, _mm_slli_epi32(VToByte(b), 16));
+  v = _mm_or_si128(v, _mm_slli_epi32(VToByte(a), 24));
+  _mm_storeu_si128((__m128i *)out, v);
+}
+#elif defined(CPU_COMPOSITOR_NEON)
+typedef float32x4_t vfloat;
+
+static inline vfloat VSplat(float f) {
+  return vdupq_n_f32(f);
+}
+static inline vfloat VAdd(vfloat a, vfloat b) {
+  return vaddq_f32(a, b);
+}
+static inline vfloat VSub(vfloat a, vfloat b) {
+  return vsubq_f32(a, b);
+}
+static inline vfloat VMul(vfloat a, vfloat b) {
+  return vmulq_f32(a, b);
+}
+static inline vfloat VMax(vfloat a, vfloat b) {
+  return vmaxq_f32(a, b);
+}
+template <int shift>
+static inline vfloat VUnpack(const uint32_t *texels) {
+  uint32x4_t v = vld1q_u32(texels);
+  if (shift)
+    v = vshrq_n_u32(v, shift ? shift : 1);
+  v = vandq_u32(v, vdupq_n_u32(0xff));
+  return vmulq_f32(vcvtq_f32_u32(v), vdupq_n_f32(1.0f / 255.0f));
+}
+static inline uint32x4_t VToByte(vfloat v) {
+  v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(1.0f));
+  v = vaddq_f32(vmulq_f32(v, vdupq_n_f32(255.0f)), vdupq_n_f32(0.5f));
+  return vcvtq_u32_f32(v);
+}
+static inline void VPack(vfloat r, vfloat g, vfloat b, vfloat a,
+                         uint32_t *out) {
+  uint32x4_t v = VToByte(r);
+  v = vorrq_u32(v, vshlq_n_u32(VToByte(g), 8));
+  v = vorrq_u32(v, vshlq_n_u32(VToByte(b), 16));
+  v = vorrq_u32(v, vshlq_n_u32(VToByte(a), 24));
+  vst1q_u32(out, v);
+}
+#else
+struct vfloat {
+  float v[4];
+};
+
+static inline vfloat VSplat(float f) {
+  return {{f, f, f, f}};
+}
+static inline vfloat VAdd(vfloat a, vfloat b) {
+  return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+}
+static inline vfloat VSub(vfloat a, vfloat b) {
+  return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}};
+}
+static inline vfloat VMul(vfloat a, vfloat b) {
+  return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+}
+static inline vfloat VMax(vfloat a, vfloat b) {
+  return {{std::max(a.v[0], b.v[0]), std::max(a.v[1], b.v[1]),
+           std::max(a.v[2], b.v[2]), std::max(a.v[3], b.v[3])}};
+}
+template <int shift>
+static inline vfloat VUnpack(const uint32_t *texels) {
+  vfloat ret;
+  for (int i = 0; i < 4; i++)
+    ret.v[i] = ((texels[i] >> shift) & 0xff) * (1.0f / 255.0f);
+  return ret;
+}
+static inline uint32_t ToByte(float f) {
+  f = std::min(std::max(f, 0.0f), 1.0f);
+  return (uint32_t)(f * 255.0f + 0.5f);
+}
+static inline void VPack(vfloat r, vfloat g, vfloat b, vfloat a,
+                         uint32_t *out) {
+  for (int i = 0; i < 4; i++)
+    out[i] = ToByte(r.v[i]) | ToByte(g.v[i]) << 8 | ToByte(b.v[i]) << 16 |
+             ToByte(a.v[i]) << 24;
+}
+#endif
+
+static inline uint32_t SwapRB(uint32_t p) {
+  return (p & 0xff00ff00) | (p & 0xff) << 16 | (p >> 16 & 0xff);
+}
+
+static inline uint32_t Expand565(uint16_t p) {
+  uint32_t r = p >> 11 & 0x1f, g = p >> 5 & 0x3f, b = p & 0x1f;
+  r = r << 3 | r >> 2;
+  g = g << 2 | g >> 4;
+  b = b << 3 | b >> 2;
+  return r | g << 8 | b << 16 | 0xff000000;
+}
+
+// Returns the texel at |x|, |y| as RGBA8888 with red in the low byte.
+static inline uint32_t LoadTexel(const CpuCompositor::Source &src, int x,
+                                 int y) {
+  const uint8_t *row = src.pixels + y * src.pitch;
+  switch (src.format) {
+    case DRM_FORMAT_ABGR8888:
+      return ((const uint32_t *)row)[x];
+    case DRM_FORMAT_XBGR8888:
+      return ((const uint32_t *)row)[x] | 0xff000000;
+    case DRM_FORMAT_ARGB8888:
+      return SwapRB(((const uint32_t *)row)[x]);
+    case DRM_FORMAT_XRGB8888:
+      return SwapRB(((const uint32_t *)row)[x]) | 0xff000000;
+    case DRM_FORMAT_BGR888: {
+      const uint8_t *p = row + x * 3;
+      return p[0] | p[1] << 8 | p[2] << 16 | 0xff000000;
+    }
+    case DRM_FORMAT_BGR565:
+      // The importer maps HAL_PIXEL_FORMAT_RGB_565 here, red is in the high
+      // bits.
+      return Expand565(((const uint16_t *)row)[x]);
+    default:
+      return 0;
+  }
+}
+
+static inline uint32_t LerpTexel(uint32_t a, uint32_t b, uint32_t w) {
+  uint32_t ret = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t ca = a >> shift & 0xff, cb = b >> shift & 0xff;
+    ret |= ((ca * (256 - w) + cb * w + 128) >> 8) << shift;
+  }
+  return ret;
+}
+
+// Matches GL_NEAREST: the texel whose area contains the sample point.
+static inline uint32_t SampleNearest(const CpuCompositor::Source &src,
+                                     float sx, float sy) {
+  int x = std::min(std::max((int)floorf(sx), 0), src.width - 1);
+  int y = std::min(std::max((int)floorf(sy), 0), src.height - 1);
+  return LoadTexel(src, x, y);
+}
+
+static inline uint32_t SampleBilinear(const CpuCompositor::Source &src,
+                                      float sx, float sy) {
+  sx -= 0.5f;
+  sy -= 0.5f;
+  float fx = floorf(sx), fy = floorf(sy);
+  uint32_t wx = (uint32_t)((sx - fx) * 256.0f);
+  uint32_t wy = (uint32_t)((sy - fy) * 256.0f);
+  int x0 = std::min(std::max((int)fx, 0), src.width - 1);
+  int y0 = std::min(std::max((int)fy, 0), src.height - 1);
+  int x1 = std::min(x0 + 1, src.width - 1);
+  int y1 = std::min(y0 + 1, src.height - 1);
+  uint32_t top = LerpTexel(LoadTexel(src, x0, y0), LoadTexel(src, x1, y0), wx);
+  uint32_t bottom =
+      LerpTexel(LoadTexel(src, x0, y1), LoadTexel(src, x1, y1), wx);
+  return LerpTexel(top, bottom, wy);
+}
+
+static void StorePixels(const CpuCompositor::Target &target, int x, int y,
+                        const uint32_t *pixels, int count) {
+  uint8_t *row = target.pixels + y * target.pitch;
+  switch (target.format) {
+    case PIXEL_FORMAT_RGBA_8888:
+    case PIXEL_FORMAT_RGBX_8888:
+      memcpy(row + x * 4, pixels, count * 4);
+      break;
+    case PIXEL_FORMAT_BGRA_8888:
+      for (int i = 0; i < count; i++)
+        ((uint32_t *)row)[x + i] = SwapRB(pixels[i]);
+      break;
+    case PIXEL_FORMAT_RGB_565:
+      for (int i = 0; i < count; i++) {
+        uint32_t p = pixels[i];
+        ((uint16_t *)row)[x + i] = (p >> 3 & 0x1f) << 11 |
+                                   (p >> 10 & 0x3f) << 5 | (p >> 19 & 0x1f);
+      }
+      break;
+  }
+}
+
+static int BytesPerPixel(int format) {
+  switch (format) {
+    case PIXEL_FORMAT_RGBA_8888:
+    case PIXEL_FORMAT_RGBX_8888:
+    case PIXEL_FORMAT_BGRA_8888:
+      return 4;
+    case PIXEL_FORMAT_RGB_565:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+// Renders the rows [y_begin, y_end) of a region. This is the same front to
+// back accumulation the GL compositor's fragment shader does:
+//   color += texel.rgb * max(texel.a, premult) * alpha * cover
+//   cover *= 1 - texel.a * alpha
+// with the output alpha being 1 - cover.
+static void RenderRows(const CpuCompositor::Command &cmd,
+                       const CpuCompositor::Target &target, bool bilinear,
+                       int y_begin, int y_end) {
+  int left = cmd.bounds[0], right = cmd.bounds[2];
+  uint32_t texels[4];
+  uint32_t out[4];
+
+  for (int y = y_begin; y < y_end; y++) {
+    float ry = y - cmd.bounds[1] + 0.5f;
+    for (int x = left; x < right; x += 4) {
+      int count = std::min(4, right - x);
+      vfloat r = VSplat(0.0f), g = VSplat(0.0f), b = VSplat(0.0f);
+      vfloat cover = VSplat(1.0f);
+
+      for (const CpuCompositor::Source &src : cmd.sources) {
+        float rx = x - left + 0.5f;
+        float sx = src.origin[0] + src.dx[0] * rx + src.dy[0] * ry;
+        float sy = src.origin[1] + src.dx[1] * rx + src.dy[1] * ry;
+        for (int i = 0; i < 4; i++) {
+          texels[i] = i >= count ? 0 : bilinear ? SampleBilinear(src, sx, sy)
+                                                : SampleNearest(src, sx, sy);
+          sx += src.dx[0];
+          sy += src.dx[1];
+        }
+
+        vfloat ta = VUnpack<24>(texels);
+        vfloat alpha = VSplat(src.alpha);
+        vfloat weight =
+            VMul(VMul(VMax(ta, VSplat(src.premult)), alpha), cover);
+        r = VAdd(r, VMul(VUnpack<0>(texels), weight));
+        g = VAdd(g, VMul(VUnpack<8>(texels), weight));
+        b = VAdd(b, VMul(VUnpack<16>(texels), weight));
+        cover = VMul(cover, VSub(VSplat(1.0f), VMul(ta, alpha)));
+      }
+
+      VPack(r, g, b, VSub(VSplat(1.0f), cover), out);
+      StorePixels(target, x, y, out, count);
+    }
+  }
+}
+
+static void RenderBand(const CpuCompositor::Job &job, size_t band,
+                       size_t num_bands) {
+  for (const CpuCompositor::Command &cmd : *job.commands) {
+    int height = cmd.bounds[3] - cmd.bounds[1];
+    int y_begin = cmd.bounds[1] + (height * band) / num_bands;
+    int y_end = cmd.bounds[1] + (height * (band + 1)) / num_bands;
+    RenderRows(cmd, job.target, job.bilinear, y_begin, y_end);
+  }
+}
+
+CpuCompositor::BandWorker::BandWorker(CpuCompositor *compositor)
+    : Worker("cpu-compositor", HAL_PRIORITY_URGENT_DISPLAY),
+      compositor_(compositor) {
+}
+
+CpuCompositor::BandWorker::~BandWorker() {
+}
+
+int CpuCompositor::BandWorker::Init() {
+  return InitWorker();
+}
+
+void CpuCompositor::BandWorker::QueueBand(const Job *job, size_t band,
+                                          size_t num_bands) {
+  Lock();
+  job_ = job;
+  band_ = band;
+  num_bands_ = num_bands;
+  SignalLocked();
+  Unlock();
+}
+
+void CpuCompositor::BandWorker::Routine() {
+  int ret = Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+
+  int wait_ret = 0;
+  if (!job_)
+    wait_ret = WaitForSignalOrExitLocked();
+
+  const Job *job = job_;
+  size_t band = band_;
+  size_t num_bands = num_bands_;
+  job_ = NULL;
+
+  ret = Unlock();
+  if (ret) {
+    ALOGE("Failed to unlock worker, %d", ret);
+    return;
+  }
+
+  if (wait_ret == -EINTR) {
+    return;
+  } else if (wait_ret) {
+    ALOGE("Failed to wait for signal, %d", wait_ret);
+    return;
+  }
+
+  if (!job)
+    return;
+
+  RenderBand(*job, band, num_bands);
+  compositor_->BandDone();
+}
+
+CpuCompositor::CpuCompositor()
+    : gralloc_(NULL),
+      bilinear_(false),
+      pending_bands_(0),
+      initialized_(false) {
+}
+
+CpuCompositor::~CpuCompositor() {
+  if (!initialized_)
+    return;
+
+  for (auto &worker : workers_)
+    worker->Exit();
+  workers_.clear();
+
+  pthread_cond_destroy(&done_cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+int CpuCompositor::Init() {
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize cpu compositor lock %d", ret);
+    return ret;
+  }
+  ret = pthread_cond_init(&done_cond_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize cpu compositor condition %d", ret);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+  initialized_ = true;
+
+  ret = hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
+                      (const hw_module_t **)&gralloc_);
+  if (ret) {
+    ALOGE("Failed to open gralloc module %d", ret);
+    return ret;
+  }
+
+  char value[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.cpu_compositor_filter", value, "nearest");
+  bilinear_ = !strcmp(value, "bilinear");
+
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  property_get("hwc.drm.cpu_compositor_threads", value, "0");
+  int num_threads = atoi(value);
+  if (num_threads <= 0)
+    num_threads = num_cpus > 0 ? num_cpus : 1;
+  num_threads = std::min(num_threads, kMaxThreads);
+
+  // The calling thread renders one of the bands itself.
+  for (int i = 1; i < num_threads; i++) {
+    std::unique_ptr<BandWorker> worker(new BandWorker(this));
+    ret = worker->Init();
+    if (ret) {
+      ALOGW("Failed to start cpu compositor thread %d, continuing with %zu",
+            ret, workers_.size());
+      break;
+    }
+    workers_.emplace_back(std::move(worker));
+  }
+
+  return 0;
+}
+
+void CpuCompositor::BandDone() {
+  AutoLock lock(&lock_, "cpu-compositor");
+  if (lock.Lock())
+    return;
+  if (--pending_bands_ == 0)
+    pthread_cond_signal(&done_cond_);
+}
+
+int CpuCompositor::RunJob(const Job &job) {
+  size_t num_bands = workers_.size() + 1;
+
+  AutoLock lock(&lock_, "cpu-compositor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  pending_bands_ = workers_.size();
+  lock.Unlock();
+
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i]->QueueBand(&job, i + 1, num_bands);
+
+  RenderBand(job, 0, num_bands);
+
+  ret = lock.Lock();
+  if (ret)
+    return ret;
+  while (pending_bands_ > 0)
+    pthread_cond_wait(&done_cond_, &lock_);
+  return 0;
+}
+
+bool CpuCompositor::IsSupportedFormat(uint32_t format) {
+  switch (format) {
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_BGR888:
+    case DRM_FORMAT_BGR565:
+      return true;
+    default:
+      return false;
+  }
+}
+
+int CpuCompositor::Composite(DrmHwcLayer *layers,
+                             DrmCompositionRegion *regions, size_t num_regions,
+                             const sp<GraphicBuffer> &framebuffer,
+                             const DrmHwcRect<int> &fb_frame) {
+  ATRACE_CALL();
+  int ret = 0;
+
+  if (num_regions == 0)
+    return -EALREADY;
+
+  Target target;
+  target.format = framebuffer->getPixelFormat();
+  target.width = framebuffer->getWidth();
+  target.height = framebuffer->getHeight();
+  target.pitch = framebuffer->getStride() * BytesPerPixel(target.format);
+  if (!target.pitch) {
+    ALOGE("Unsupported framebuffer format %d", target.format);
+    return -EINVAL;
+  }
+
+  std::vector<RenderingCommand> rendering_commands(num_regions);
+  std::unordered_map<size_t, const uint8_t *> layer_pixels;
+  for (size_t region_index = 0; region_index < num_regions; region_index++) {
+    ConstructCommand(layers, regions[region_index], fb_frame,
+                     rendering_commands[region_index]);
+    for (size_t layer_index : regions[region_index].source_layers)
+      layer_pixels.emplace(layer_index, nullptr);
+  }
+
+  for (auto &entry : layer_pixels) {
+    DrmHwcLayer &layer = layers[entry.first];
+    if (!IsSupportedFormat(layer.buffer->format)) {
+      ALOGE("Unsupported layer format %c%c%c%c", layer.buffer->format,
+            layer.buffer->format >> 8, layer.buffer->format >> 16,
+            layer.buffer->format >> 24);
+      ret = -EINVAL;
+      break;
+    }
+
+    if (layer.acquire_fence.get() >= 0) {
+      ret = sync_wait(layer.acquire_fence.get(), kAcquireWaitTimeoutMs);
+      if (ret) {
+        ALOGE("Failed to wait for acquire fence %d", ret);
+        break;
+      }
+      layer.acquire_fence.Close();
+    }
+
+    void *vaddr = NULL;
+    ret = gralloc_->lock(gralloc_, layer.get_usable_handle(),
+                         GRALLOC_USAGE_SW_READ_OFTEN, 0, 0,
+                         layer.buffer->width, layer.buffer->height, &vaddr);
+    if (ret) {
+      ALOGE("Failed to lock layer buffer %d", ret);
+      break;
+    }
+    entry.second = (const uint8_t *)vaddr + layer.buffer->offsets[0];
+  }
+
+  void *fb_vaddr = NULL;
+  if (!ret) {
+    ret = framebuffer->lock(GRALLOC_USAGE_SW_WRITE_OFTEN, &fb_vaddr);
+    if (ret)
+      ALOGE("Failed to lock framebuffer %d", ret);
+  }
+
+  if (!ret) {
+    target.pixels = (uint8_t *)fb_vaddr;
+    memset(target.pixels, 0, target.pitch * target.height);
+
+    std::vector<Command> commands;
+    for (const RenderingCommand &rcmd : rendering_commands) {
+      if (rcmd.texture_count == 0)
+        continue;
+
+      Command cmd;
+      cmd.bounds[0] = std::max((int)rcmd.bounds[0], 0);
+      cmd.bounds[1] = std::max((int)rcmd.bounds[1], 0);
+      cmd.bounds[2] = std::min((int)rcmd.bounds[2], target.width);
+      cmd.bounds[3] = std::min((int)rcmd.bounds[3], target.height);
+      if (cmd.bounds[0] >= cmd.bounds[2] || cmd.bounds[1] >= cmd.bounds[3])
+        continue;
+
+      // Sampling is relative to the unclipped region so that clipping does
+      // not shift the image.
+      float offset[2] = {cmd.bounds[0] - rcmd.bounds[0],
+                         cmd.bounds[1] - rcmd.bounds[1]};
+      float size[2] = {rcmd.bounds[2] - rcmd.bounds[0],
+                       rcmd.bounds[3] - rcmd.bounds[1]};
+
+      for (unsigned i = 0; i < rcmd.texture_count; i++) {
+        const RenderingCommand::TextureSource &tex = rcmd.textures[i];
+        const DrmHwcLayer &layer = layers[tex.texture_index];
+        bool swap_xy = tex.texture_matrix[1] != 0.0f;
+
+        Source src;
+        src.pixels = layer_pixels[tex.texture_index];
+        src.pitch = layer.buffer->pitches[0];
+        src.format = layer.buffer->format;
+        src.width = layer.buffer->width;
+        src.height = layer.buffer->height;
+        src.alpha = tex.alpha;
+        src.premult = tex.premult;
+
+        float extent[2] = {
+            (tex.crop_bounds[2] - tex.crop_bounds[0]) * src.width,
+            (tex.crop_bounds[3] - tex.crop_bounds[1]) * src.height};
+        src.dx[0] = swap_xy ? 0.0f : extent[0] / size[0];
+        src.dx[1] = swap_xy ? extent[1] / size[0] : 0.0f;
+        src.dy[0] = swap_xy ? extent[0] / size[1] : 0.0f;
+        src.dy[1] = swap_xy ? 0.0f : extent[1] / size[1];
+        src.origin[0] = tex.crop_bounds[0] * src.width +
+                        src.dx[0] * offset[0] + src.dy[0] * offset[1];
+        src.origin[1] = tex.crop_bounds[1] * src.height +
+                        src.dx[1] * offset[0] + src.dy[1] * offset[1];
+        cmd.sources.emplace_back(src);
+      }
+      commands.emplace_back(std::move(cmd));
+    }
+
+    Job job;
+    job.commands = &commands;
+    job.target = target;
+    job.bilinear = bilinear_;
+    ret = RunJob(job);
+    if (ret)
+      ALOGE("Failed to render cpu composition %d", ret);
+
+    framebuffer->unlock();
+  }
+
+  for (auto &entry : layer_pixels) {
+    if (entry.second)
+      gralloc_->unlock(gralloc_, layers[entry.first].get_usable_handle());
+  }
+
+  return ret;
+}
+
+void CpuCompositor::Finish() {
+  // Rendering is complete by the time Composite returns.
+}
+}
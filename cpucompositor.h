@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_CPU_COMPOSITOR_H_
+#define ANDROID_CPU_COMPOSITOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include <hardware/gralloc.h>
+
+#include "precompositor.h"
+#include "worker.h"
+
+namespace android {
+
+// Renders composition regions with the CPU into a gralloc buffer mapped for
+// software access. Blending follows the GL compositor's shader exactly so the
+// two backends produce the same output, which also makes this a reference
+// implementation for the GL path.
+//
+// The framebuffer is split into horizontal bands which are rendered in
+// parallel by a small pool of worker threads, with the calling thread taking
+// the first band.
+class CpuCompositor : public PreCompositor {
+ public:
+  CpuCompositor();
+  ~CpuCompositor() override;
+
+  int Init() override;
+  int Composite(DrmHwcLayer *layers, DrmCompositionRegion *regions,
+                size_t num_regions, const sp<GraphicBuffer> &framebuffer,
+                const DrmHwcRect<int> &fb_frame) override;
+  void Finish() override;
+
+  uint32_t framebuffer_usage() const override {
+    return GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+  }
+
+  const char *name() const override {
+    return "cpu";
+  }
+
+  // Returns true if the blending kernels can read buffers of the given drm
+  // fourcc format.
+  static bool IsSupportedFormat(uint32_t format);
+
+  struct Source {
+    const uint8_t *pixels;
+    uint32_t pitch;
+    uint32_t format;
+    int width;
+    int height;
+
+    // Source texel coordinates of the region's top-left corner, and their
+    // derivatives along the destination x and y axes.
+    float origin[2];
+    float dx[2];
+    float dy[2];
+
+    float alpha;
+    float premult;
+  };
+
+  struct Command {
+    int bounds[4];
+    std::vector<Source> sources;
+  };
+
+  struct Target {
+    uint8_t *pixels;
+    uint32_t pitch;
+    int format;
+    int width;
+    int height;
+  };
+
+  struct Job {
+    const std::vector<Command> *commands;
+    Target target;
+    bool bilinear;
+  };
+
+ private:
+  class BandWorker : public Worker {
+   public:
+    BandWorker(CpuCompositor *compositor);
+    ~BandWorker() override;
+
+    int Init();
+    void QueueBand(const Job *job, size_t band, size_t num_bands);
+
+   protected:
+    void Routine() override;
+
+   private:
+    CpuCompositor *compositor_;
+    const Job *job_ = NULL;
+    size_t band_ = 0;
+    size_t num_bands_ = 0;
+  };
+
+  // Somewhat arbitrary, there is little to gain beyond this for the region
+  // counts we see and each thread costs an extra stack.
+  static const int kMaxThreads = 4;
+  static const int kAcquireWaitTimeoutMs = 3000;
+
+  int RunJob(const Job &job);
+  void BandDone();
+
+  const gralloc_module_t *gralloc_;
+  std::vector<std::unique_ptr<BandWorker>> workers_;
+  bool bilinear_;
+
+  pthread_mutex_t lock_;
+  pthread_cond_t done_cond_;
+  size_t pending_bands_;
+
+  bool initialized_;
+};
+}
+
+#endif  // ANDROID_CPU_COMPOSITOR_H_
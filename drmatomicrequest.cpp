@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-atomic-request"
+
+#include "drmatomicrequest.h"
+#include "autolock.h"
+
+#include <errno.h>
+
+#include <cutils/log.h>
+
+namespace android {
+
+DrmPropertyShadow::DrmPropertyShadow()
+    : num_invalidations_(0), initialized_(false) {
+}
+
+DrmPropertyShadow::~DrmPropertyShadow() {
+  if (initialized_)
+    pthread_mutex_destroy(&lock_);
+}
+
+int DrmPropertyShadow::Init() {
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize property shadow lock %d", ret);
+    return ret;
+  }
+  initialized_ = true;
+  return 0;
+}
+
+bool DrmPropertyShadow::Matches(uint32_t object_id, uint32_t property_id,
+                                uint64_t value) const {
+  AutoLock lock(&lock_, "property-shadow");
+  if (lock.Lock())
+    return false;
+
+  auto it = values_.find(Key(object_id, property_id));
+  return it != values_.end() && it->second == value;
+}
+
+void DrmPropertyShadow::Update(const std::vector<Value> &values) {
+  AutoLock lock(&lock_, "property-shadow");
+  if (lock.Lock())
+    return;
+
+  for (const Value &value : values)
+    values_[Key(value.object_id, value.property_id)] = value.value;
+}
+
+void DrmPropertyShadow::Invalidate() {
+  AutoLock lock(&lock_, "property-shadow");
+  if (lock.Lock())
+    return;
+
+  values_.clear();
+  num_invalidations_++;
+}
+
+void DrmPropertyShadow::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "property-shadow");
+  if (lock.Lock())
+    return;
+
+  *out << "  Property shadow: values=" << values_.size()
+       << " invalidations=" << num_invalidations_ << "\n";
+}
+
+DrmAtomicRequest::DrmAtomicRequest()
+    : shadow_(NULL), req_(NULL), num_properties_(0), num_skipped_(0) {
+}
+
+DrmAtomicRequest::~DrmAtomicRequest() {
+  if (req_)
+    drmModeAtomicFree(req_);
+}
+
+int DrmAtomicRequest::Init(DrmPropertyShadow *shadow) {
+  req_ = drmModeAtomicAlloc();
+  if (!req_) {
+    ALOGE("Failed to allocate atomic request");
+    return -ENOMEM;
+  }
+  shadow_ = shadow;
+  return 0;
+}
+
+void DrmAtomicRequest::Reset() {
+  drmModeAtomicSetCursor(req_, 0);
+  num_properties_ = 0;
+  pending_.clear();
+}
+
+int DrmAtomicRequest::AddProperty(uint32_t object_id, uint32_t property_id,
+                                  uint64_t value) {
+  if (shadow_ && shadow_->Matches(object_id, property_id, value)) {
+    num_skipped_++;
+    return 0;
+  }
+  return ForceProperty(object_id, property_id, value, true);
+}
+
+int DrmAtomicRequest::ForceProperty(uint32_t object_id, uint32_t property_id,
+                                    uint64_t value, bool is_state) {
+  int ret = drmModeAtomicAddProperty(req_, object_id, property_id, value);
+  if (ret < 0)
+    return ret;
+
+  num_properties_++;
+  if (is_state)
+    pending_.push_back({object_id, property_id, value});
+  return 0;
+}
+
+void DrmAtomicRequest::Committed() {
+  if (shadow_)
+    shadow_->Update(pending_);
+  pending_.clear();
+}
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_ATOMIC_REQUEST_H_
+#define ANDROID_DRM_ATOMIC_REQUEST_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+namespace android {
+
+// The value each object property was last committed with, shared by
+// everything that commits to the device. Planes move between CRTCs, so this
+// can't be tracked per display.
+class DrmPropertyShadow {
+ public:
+  struct Value {
+    uint32_t object_id;
+    uint32_t property_id;
+    uint64_t value;
+  };
+
+  DrmPropertyShadow();
+  ~DrmPropertyShadow();
+
+  int Init();
+
+  bool Matches(uint32_t object_id, uint32_t property_id, uint64_t value) const;
+  void Update(const std::vector<Value> &values);
+  // Forgets everything, e.g. when something else may have changed the state
+  // behind our back.
+  void Invalidate();
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  static uint64_t Key(uint32_t object_id, uint32_t property_id) {
+    return ((uint64_t)object_id << 32) | property_id;
+  }
+
+  std::unordered_map<uint64_t, uint64_t> values_;
+  uint64_t num_invalidations_;
+
+  bool initialized_;
+  mutable pthread_mutex_t lock_;
+};
+
+// An atomic request that only carries the properties whose value differs
+// from what was last committed. The underlying drmModeAtomicReq is kept and
+// rewound between commits instead of being reallocated every frame.
+//
+// Not thread safe, each thread that commits needs a request of its own.
+class DrmAtomicRequest {
+ public:
+  DrmAtomicRequest();
+  ~DrmAtomicRequest();
+
+  // Without |shadow| every property is sent
+  int Init(DrmPropertyShadow *shadow);
+
+  // Drops all properties, ready for the next commit
+  void Reset();
+
+  // Adds the property unless it is known to hold |value| already
+  int AddProperty(uint32_t object_id, uint32_t property_id, uint64_t value);
+  // Adds the property even if its value didn't change. Used for FB_ID, which
+  // is what makes a plane flip, and for properties that aren't state, such
+  // as fences, which are then left out of the shadow.
+  int ForceProperty(uint32_t object_id, uint32_t property_id, uint64_t value,
+                    bool is_state);
+
+  // Records the request as committed, call after a commit without TEST_ONLY
+  // went through.
+  void Committed();
+
+  bool empty() const {
+    return num_properties_ == 0;
+  }
+
+  // Whether properties that didn't change are left out
+  bool is_delta() const {
+    return shadow_ != NULL;
+  }
+
+  drmModeAtomicReqPtr get() const {
+    return req_;
+  }
+
+  uint64_t num_skipped() const {
+    return num_skipped_;
+  }
+
+ private:
+  DrmAtomicRequest(const DrmAtomicRequest &) = delete;
+
+  DrmPropertyShadow *shadow_;
+  drmModeAtomicReqPtr req_;
+  size_t num_properties_;
+  std::vector<DrmPropertyShadow::Value> pending_;
+  uint64_t num_skipped_;
+};
+}
+
+#endif  // ANDROID_DRM_ATOMIC_REQUEST_H_
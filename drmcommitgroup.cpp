@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-drm-commit-group"
+
+#include "drmcommitgroup.h"
+#include "autolock.h"
+#include "drmdisplaycompositor.h"
+#include "drmeventlistener.h"
+#include "drmresources.h"
+
+#include <time.h>
+#include <cinttypes>
+
+#include <cutils/log.h>
+#include <utils/Trace.h>
+#include <xf86drm.h>
+
+namespace android {
+
+// The kernel sends one page flip event per CRTC in the commit, all of them
+// carrying the same user data.
+class GroupFlipHandler : public DrmEventHandler {
+ public:
+  GroupFlipHandler(const std::vector<DrmDisplayCompositor *> &compositors)
+      : compositors_(compositors), pending_events_(compositors.size()) {
+  }
+
+  void HandleEvent(uint64_t timestamp_us) override {
+    if (pending_events_ > 0)
+      pending_events_--;
+    if (pending_events_ > 0)
+      return;
+    for (DrmDisplayCompositor *compositor : compositors_)
+      compositor->FlipComplete(timestamp_us);
+  }
+
+  bool HandledAllEvents() const override {
+    return pending_events_ == 0;
+  }
+
+ private:
+  std::vector<DrmDisplayCompositor *> compositors_;
+  size_t pending_events_;
+};
+
+DrmCommitGroup::DrmCommitGroup()
+    : drm_(NULL),
+      frame_no_(0),
+      num_commits_(0),
+      num_abandoned_(0),
+      num_failed_(0),
+      initialized_(false) {
+}
+
+DrmCommitGroup::~DrmCommitGroup() {
+  if (!initialized_)
+    return;
+  pthread_cond_destroy(&done_cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+int DrmCommitGroup::Init(DrmResources *drm) {
+  drm_ = drm;
+
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize commit group lock %d", ret);
+    return ret;
+  }
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  ret = pthread_cond_init(&done_cond_, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  if (ret) {
+    ALOGE("Failed to initialize commit group condition %d", ret);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+
+  initialized_ = true;
+  return 0;
+}
+
+size_t DrmCommitGroup::ExpectedLocked(uint64_t frame_no) const {
+  auto it = expected_.find(frame_no);
+  return it == expected_.end() ? 0 : it->second;
+}
+
+void DrmCommitGroup::Expect(uint64_t frame_no, size_t num_displays) {
+  AutoLock lock(&lock_, "commit-group");
+  if (lock.Lock())
+    return;
+  if (num_displays > 1)
+    expected_[frame_no] = num_displays;
+}
+
+void DrmCommitGroup::Withdraw(uint64_t frame_no) {
+  AutoLock lock(&lock_, "commit-group");
+  if (lock.Lock())
+    return;
+
+  auto it = expected_.find(frame_no);
+  if (it == expected_.end())
+    return;
+  if (it->second > 0)
+    it->second--;
+  if (frame_no == frame_no_)
+    CommitIfCompleteLocked();
+}
+
+void DrmCommitGroup::Cancel(uint64_t frame_no) {
+  AutoLock lock(&lock_, "commit-group");
+  if (lock.Lock())
+    return;
+
+  expected_.erase(frame_no);
+  if (frame_no == frame_no_ && !members_.empty())
+    AbandonLocked();
+}
+
+// Everybody waiting is sent off to commit on their own
+void DrmCommitGroup::AbandonLocked() {
+  for (Member *member : members_) {
+    member->result = -EAGAIN;
+    member->done = true;
+  }
+  members_.clear();
+  expected_.erase(expected_.begin(), expected_.upper_bound(frame_no_));
+  num_abandoned_++;
+  pthread_cond_broadcast(&done_cond_);
+}
+
+void DrmCommitGroup::CommitIfCompleteLocked() {
+  if (members_.empty() || members_.size() < ExpectedLocked(frame_no_))
+    return;
+
+  ATRACE_CALL();
+  int ret = 0;
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate combined property set");
+    ret = -ENOMEM;
+  }
+
+  std::vector<DrmDisplayCompositor *> compositors;
+  for (Member *member : members_) {
+    compositors.push_back(member->compositor);
+    if (!ret)
+      ret = drmModeAtomicMerge(pset, member->pset);
+  }
+
+  if (!ret) {
+    GroupFlipHandler *handler = new GroupFlipHandler(compositors);
+    ret = drmModeAtomicCommit(
+        drm_->fd(), pset, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+        handler);
+    if (ret) {
+      ALOGW("Failed combined commit of frame %" PRIu64 " ret=%d", frame_no_,
+            ret);
+      delete handler;
+    }
+  }
+  if (pset)
+    drmModeAtomicFree(pset);
+
+  if (ret) {
+    num_failed_++;
+    ret = -EAGAIN;
+  } else {
+    num_commits_++;
+  }
+
+  for (Member *member : members_) {
+    member->result = ret;
+    member->done = true;
+  }
+  members_.clear();
+  expected_.erase(expected_.begin(), expected_.upper_bound(frame_no_));
+  pthread_cond_broadcast(&done_cond_);
+}
+
+int DrmCommitGroup::Commit(uint64_t frame_no, DrmDisplayCompositor *compositor,
+                           drmModeAtomicReqPtr pset) {
+  ATRACE_CALL();
+  AutoLock lock(&lock_, "commit-group");
+  if (lock.Lock())
+    return -EAGAIN;
+
+  if (ExpectedLocked(frame_no) < 2)
+    return -EAGAIN;
+
+  if (!members_.empty() && frame_no != frame_no_) {
+    // Whoever is waiting for an older frame won't see it completed now that
+    // a display has moved past it.
+    if (frame_no < frame_no_)
+      return -EAGAIN;
+    AbandonLocked();
+  }
+
+  Member member;
+  member.compositor = compositor;
+  member.pset = pset;
+  frame_no_ = frame_no;
+  members_.push_back(&member);
+  CommitIfCompleteLocked();
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  int64_t nanos = deadline.tv_nsec + kWaitTimeoutNs;
+  deadline.tv_sec += nanos / (1000 * 1000 * 1000);
+  deadline.tv_nsec = nanos % (1000 * 1000 * 1000);
+
+  int ret = 0;
+  while (!member.done && !ret)
+    ret = pthread_cond_timedwait(&done_cond_, &lock_, &deadline);
+
+  if (!member.done) {
+    ALOGW("Gave up waiting for displays to join frame %" PRIu64, frame_no);
+    AbandonLocked();
+  }
+  return member.result;
+}
+
+void DrmCommitGroup::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "commit-group");
+  if (lock.Lock())
+    return;
+
+  *out << "  Combined commits: committed=" << num_commits_
+       << " abandoned=" << num_abandoned_ << " failed=" << num_failed_
+       << " waiting=" << members_.size() << "\n";
+}
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_COMMIT_GROUP_H_
+#define ANDROID_DRM_COMMIT_GROUP_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+namespace android {
+
+class DrmDisplayCompositor;
+class DrmResources;
+
+// Gathers the atomic requests that the display compositors build for the
+// same DrmComposition and submits them to the kernel as one, so that planes
+// moving between CRTCs and changes spanning several displays land together.
+//
+// Each display compositor still prepares its frame on its own threads. Its
+// frame worker hands the request to Commit() and blocks until the last
+// display expected for that frame shows up, which then does the commit for
+// everybody. If that doesn't happen within a few milliseconds, e.g. because
+// a display skipped the frame, the group is given up on and every display
+// commits on its own as it would without a group.
+class DrmCommitGroup {
+ public:
+  DrmCommitGroup();
+  ~DrmCommitGroup();
+
+  int Init(DrmResources *drm);
+
+  // Announces how many displays will commit frame |frame_no|. Frames that
+  // were never announced, or with fewer than two displays, aren't grouped.
+  void Expect(uint64_t frame_no, size_t num_displays);
+  // Tells the group that one of the displays expected for |frame_no| won't
+  // take part after all.
+  void Withdraw(uint64_t frame_no);
+  // Gives up on grouping |frame_no| altogether
+  void Cancel(uint64_t frame_no);
+
+  // Adds the non-blocking page flip |pset| of |compositor| to the combined
+  // commit for |frame_no| and waits for it to be submitted. Returns -EAGAIN
+  // if the request wasn't committed and the caller has to commit it itself.
+  // Once the flips on all CRTCs of the commit have completed,
+  // DrmDisplayCompositor::FlipComplete() is called for each member.
+  int Commit(uint64_t frame_no, DrmDisplayCompositor *compositor,
+             drmModeAtomicReqPtr pset);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  struct Member {
+    DrmDisplayCompositor *compositor;
+    drmModeAtomicReqPtr pset;
+    bool done = false;
+    int result = -EAGAIN;
+  };
+
+  // Long enough for displays that prepare their frames in parallel to catch
+  // up with each other, short enough that a display that never shows up
+  // doesn't cost the others their vblank.
+  static const int64_t kWaitTimeoutNs = 4 * 1000 * 1000;
+
+  size_t ExpectedLocked(uint64_t frame_no) const;
+  void CommitIfCompleteLocked();
+  void AbandonLocked();
+
+  DrmResources *drm_;
+
+  // Displays expected per announced frame
+  std::map<uint64_t, size_t> expected_;
+
+  // The frame being gathered, only one at a time
+  uint64_t frame_no_;
+  std::vector<Member *> members_;
+
+  uint64_t num_commits_;
+  uint64_t num_abandoned_;
+  uint64_t num_failed_;
+
+  bool initialized_;
+  mutable pthread_mutex_t lock_;
+  pthread_cond_t done_cond_;
+};
+}
+
+#endif  // ANDROID_DRM_COMMIT_GROUP_H_
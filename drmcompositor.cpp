@@ -20,14 +20,17 @@
 #include "drmdisplaycompositor.h"
 #include "drmresources.h"
 
+#include <math.h>
 #include <sstream>
 #include <stdlib.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 namespace android {
 
-DrmCompositor::DrmCompositor(DrmResources *drm) : drm_(drm), frame_no_(0) {
+DrmCompositor::DrmCompositor(DrmResources *drm)
+    : drm_(drm), frame_no_(0), combined_commit_(false), shared_gl_(false) {
 }
 
 DrmCompositor::~DrmCompositor() {
@@ -43,6 +46,31 @@ int DrmCompositor::Init() {
     }
   }
 
+  char value[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.combined_commit", value, "0");
+  combined_commit_ = atoi(value) != 0;
+  if (combined_commit_) {
+    int ret = commit_group_.Init(drm_);
+    if (ret) {
+      ALOGE("Failed to initialize commit group %d", ret);
+      return ret;
+    }
+    for (auto &conn : drm_->connectors())
+      compositor_map_[conn->display()].set_commit_group(&commit_group_);
+  }
+
+  property_get("hwc.drm.shared_gl", value, "1");
+  shared_gl_ = atoi(value) != 0;
+  if (shared_gl_) {
+    int ret = gl_service_.Init();
+    if (ret) {
+      ALOGE("Failed to initialize shared GL compositor %d", ret);
+      return ret;
+    }
+    for (auto &conn : drm_->connectors())
+      compositor_map_[conn->display()].set_gl_service(&gl_service_);
+  }
+
   return 0;
 }
 
@@ -58,6 +86,31 @@ std::unique_ptr<DrmComposition> DrmCompositor::CreateComposition(
   return composition;
 }
 
+// The frames of all displays in |composition| are committed together, as
+// long as the displays refresh at the same rate. Otherwise the faster display
+// would be held back to the pace of the slower one, so each display commits
+// on its own.
+void DrmCompositor::ExpectCombinedCommit(DrmComposition *composition) {
+  size_t num_frames = 0;
+  uint64_t frame_no = 0;
+  float refresh = 0.0f;
+  for (auto &conn : drm_->connectors()) {
+    DrmDisplayComposition *display_comp =
+        composition->GetDisplayComposition(conn->display());
+    if (!display_comp || display_comp->type() != DRM_COMPOSITION_TYPE_FRAME)
+      continue;
+
+    float display_refresh = conn->active_mode().v_refresh();
+    if (num_frames && fabsf(display_refresh - refresh) > 0.5f)
+      return;
+    refresh = display_refresh;
+    frame_no = display_comp->frame_no();
+    num_frames++;
+  }
+
+  commit_group_.Expect(frame_no, num_frames);
+}
+
 int DrmCompositor::QueueComposition(
     std::unique_ptr<DrmComposition> composition) {
   int ret;
@@ -70,12 +123,20 @@ int DrmCompositor::QueueComposition(
   if (ret)
     return ret;
 
+  if (combined_commit_)
+    ExpectCombinedCommit(composition.get());
+
   for (auto &conn : drm_->connectors()) {
     int display = conn->display();
-    int ret = compositor_map_[display].QueueComposition(
-        composition->TakeDisplayComposition(display));
+    std::unique_ptr<DrmDisplayComposition> display_comp =
+        composition->TakeDisplayComposition(display);
+    uint64_t frame_no = display_comp ? display_comp->frame_no() : 0;
+    int ret =
+        compositor_map_[display].QueueComposition(std::move(display_comp));
     if (ret) {
       ALOGE("Failed to queue composition for display %d (%d)", display, ret);
+      if (combined_commit_)
+        commit_group_.Cancel(frame_no);
       return ret;
     }
   }
@@ -92,8 +153,20 @@ int DrmCompositor::Composite() {
   return -EINVAL;
 }
 
+VSyncModel *DrmCompositor::GetVSyncModel(int display) {
+  auto it = compositor_map_.find(display);
+  if (it == compositor_map_.end())
+    return NULL;
+  return it->second.vsync_model();
+}
+
 void DrmCompositor::Dump(std::ostringstream *out) const {
   *out << "DrmCompositor stats:\n";
+  if (combined_commit_)
+    commit_group_.Dump(out);
+  if (shared_gl_)
+    gl_service_.Dump(out);
+  drm_->property_shadow()->Dump(out);
   for (auto &conn : drm_->connectors())
     compositor_map_[conn->display()].Dump(out);
 }
@@ -17,8 +17,10 @@
 #ifndef ANDROID_DRM_COMPOSITOR_H_
 #define ANDROID_DRM_COMPOSITOR_H_
 
+#include "drmcommitgroup.h"
 #include "drmcomposition.h"
 #include "drmdisplaycompositor.h"
+#include "glcompositorservice.h"
 #include "importer.h"
 
 #include <map>
@@ -40,13 +42,26 @@ class DrmCompositor {
   int Composite();
   void Dump(std::ostringstream *out) const;
 
+  // NULL if there's no such display
+  VSyncModel *GetVSyncModel(int display);
+
  private:
   DrmCompositor(const DrmCompositor &) = delete;
 
+  void ExpectCombinedCommit(DrmComposition *composition);
+
   DrmResources *drm_;
 
   uint64_t frame_no_;
 
+  // Combined commits across displays, see DrmCommitGroup
+  bool combined_commit_;
+  DrmCommitGroup commit_group_;
+
+  // One GL context for the precomposition of all displays
+  bool shared_gl_;
+  GLCompositorService gl_service_;
+
   // mutable for Dump() propagation
   mutable std::map<int, DrmDisplayCompositor> compositor_map_;
 };
@@ -27,8 +27,6 @@
 
 namespace android {
 
-static const int64_t kSquashWait = 500000000LL;
-
 DrmCompositorWorker::DrmCompositorWorker(DrmDisplayCompositor *compositor)
     : Worker("drm-compositor", HAL_PRIORITY_URGENT_DISPLAY),
       compositor_(compositor) {
@@ -50,11 +48,9 @@ void DrmCompositorWorker::Routine() {
       return;
     }
 
-    // Only use a timeout if we didn't do a SquashAll last time. This will
-    // prevent wait_ret == -ETIMEDOUT which would trigger a SquashAll and be a
-    // pointless drain on resources.
-    int wait_ret = did_squash_all_ ? WaitForSignalOrExitLocked()
-                                   : WaitForSignalOrExitLocked(kSquashWait);
+    // Squashing an idle display is up to the compositor's squash worker
+    int wait_ret = WaitForWorkOrExitLocked(
+        [this] { return compositor_->HaveQueuedComposites(); });
 
     ret = Unlock();
     if (ret) {
@@ -67,12 +63,6 @@ void DrmCompositorWorker::Routine() {
         break;
       case -EINTR:
         return;
-      case -ETIMEDOUT:
-        ret = compositor_->SquashAll();
-        if (ret)
-          ALOGE("Failed to squash all %d", ret);
-        did_squash_all_ = true;
-        return;
       default:
         ALOGE("Failed to wait for signal, %d", wait_ret);
         return;
@@ -82,6 +72,5 @@ void DrmCompositorWorker::Routine() {
   ret = compositor_->Composite();
   if (ret)
     ALOGE("Failed to composite! %d", ret);
-  did_squash_all_ = false;
 }
 }
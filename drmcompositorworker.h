@@ -34,7 +34,6 @@ class DrmCompositorWorker : public Worker {
   void Routine() override;
 
   DrmDisplayCompositor *compositor_;
-  bool did_squash_all_ = false;
 };
 }
 
@@ -40,6 +40,7 @@ const size_t DrmCompositionPlane::kSourceLayerMax;
 
 DrmDisplayComposition::~DrmDisplayComposition() {
   if (timeline_fd_ >= 0) {
+    FinishRender();
     SignalCompositionDone();
     close(timeline_fd_);
   }
@@ -85,6 +86,35 @@ int DrmDisplayComposition::IncreaseTimelineToPoint(int point) {
   return ret;
 }
 
+int DrmDisplayComposition::AddRenderFence(int fence) {
+  if (render_fence_.get() < 0) {
+    render_fence_.Set(fence);
+    return 0;
+  }
+
+  int merged = sync_merge("hwc drm render fence", render_fence_.get(), fence);
+  close(fence);
+  if (merged < 0) {
+    ALOGE("Failed to merge render fences %d", merged);
+    return merged;
+  }
+  render_fence_.Set(merged);
+  return 0;
+}
+
+int DrmDisplayComposition::FinishRender() {
+  if (render_fence_.get() < 0)
+    return 0;
+
+  int ret = sync_wait(render_fence_.get(), kRenderWaitTimeoutMs);
+  if (ret)
+    ALOGE("Failed to wait for render fence %d/%d", render_fence_.get(), ret);
+  render_fence_.Close();
+
+  SignalSquashDone();
+  return SignalPreCompDone();
+}
+
 int DrmDisplayComposition::SetLayers(DrmHwcLayer *layers, size_t num_layers,
                                      bool geometry_changed) {
   if (!validate_composition_type(DRM_COMPOSITION_TYPE_FRAME))
@@ -84,6 +84,12 @@ class DrmDisplayComposition {
     return IncreaseTimelineToPoint(timeline_);
   }
 
+  // Squash and precomposition rendering that was submitted without waiting
+  // for it to complete. FinishRender() waits for all of it, then releases the
+  // layers it read from.
+  int AddRenderFence(int fence);
+  int FinishRender();
+
   std::vector<DrmHwcLayer> &layers() {
     return layers_;
   }
@@ -103,6 +109,9 @@ class DrmDisplayComposition {
   bool geometry_changed() const {
     return geometry_changed_;
   }
+  void set_geometry_changed(bool geometry_changed) {
+    geometry_changed_ = geometry_changed;
+  }
 
   uint64_t frame_no() const {
     return frame_no_;
@@ -133,6 +142,10 @@ class DrmDisplayComposition {
  private:
   bool validate_composition_type(DrmCompositionType desired);
 
+  // Long enough for any sane render, short enough not to hang the display
+  // when the GPU does.
+  static const int kRenderWaitTimeoutMs = 1000;
+
   int IncreaseTimelineToPoint(int point);
 
   void EmplaceCompositionPlane(size_t source_layer,
@@ -161,6 +174,7 @@ class DrmDisplayComposition {
   std::vector<DrmCompositionPlane> composition_planes_;
 
   uint64_t frame_no_ = 0;
+  UniqueFd render_fence_;
 };
 }
 
@@ -20,18 +20,24 @@
 #include "drmdisplaycompositor.h"
 
 #include <pthread.h>
-#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <algorithm>
 #include <sstream>
 #include <vector>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
 #include <sync/sync.h>
+#include <utils/ThreadDefs.h>
 #include <utils/Trace.h>
 
 #include "autolock.h"
+#include "cpucompositor.h"
+#include "drmcommitgroup.h"
 #include "drmcrtc.h"
 #include "drmplane.h"
 #include "drmresources.h"
@@ -39,6 +45,13 @@
 
 #define DRM_DISPLAY_COMPOSITOR_MAX_QUEUE_DEPTH 2
 
+// How long SurfaceFlinger may be held up by a full queue before the frame is
+// dropped. Dropped frames signal their fences as they are destroyed.
+#define DRM_DISPLAY_COMPOSITOR_QUEUE_TIMEOUT_NS (1000LL * 1000 * 1000)
+
+// A page flip that takes longer than this is assumed to have been lost.
+#define DRM_DISPLAY_COMPOSITOR_FLIP_TIMEOUT_NS (1000LL * 1000 * 1000)
+
 namespace android {
 
 void SquashState::Init(DrmHwcLayer *layers, size_t num_layers) {
@@ -169,6 +182,9 @@ void SquashState::Dump(std::ostringstream *out) const {
   }
 }
 
+static const PixelFormat kFramebufferFormats[DRM_DISPLAY_BUFFER_FORMATS] = {
+    PIXEL_FORMAT_RGBA_8888, PIXEL_FORMAT_RGBX_8888, PIXEL_FORMAT_RGB_565};
+
 static bool UsesSquash(const std::vector<DrmCompositionPlane> &comp_planes) {
   return std::any_of(comp_planes.begin(), comp_planes.end(),
                      [](const DrmCompositionPlane &plane) {
@@ -185,19 +201,30 @@ DrmDisplayCompositor::FrameWorker::FrameWorker(DrmDisplayCompositor *compositor)
 DrmDisplayCompositor::FrameWorker::~FrameWorker() {
 }
 
-int DrmDisplayCompositor::FrameWorker::Init() {
+int DrmDisplayCompositor::FrameWorker::Init(size_t max_depth) {
+  // Frames come from the compositor worker and the squash worker
+  int ret = frame_queue_.Init(max_depth);
+  if (ret) {
+    ALOGE("Failed to initialize frame queue %d", ret);
+    return ret;
+  }
   return InitWorker();
 }
 
-void DrmDisplayCompositor::FrameWorker::QueueFrame(
-    std::unique_ptr<DrmDisplayComposition> composition, int status) {
-  Lock();
+int DrmDisplayCompositor::FrameWorker::QueueFrame(
+    std::unique_ptr<DrmDisplayComposition> *composition, int status,
+    int64_t timeout_ns) {
   FrameState frame;
-  frame.composition = std::move(composition);
+  frame.composition = std::move(*composition);
   frame.status = status;
-  frame_queue_.push(std::move(frame));
-  SignalLocked();
-  Unlock();
+  int ret = frame_queue_.Push(std::move(frame), timeout_ns);
+  if (ret) {
+    // Push() leaves the frame alone when it times out
+    *composition = std::move(frame.composition);
+    return ret;
+  }
+  SignalIfIdle();
+  return 0;
 }
 
 void DrmDisplayCompositor::FrameWorker::Routine() {
@@ -207,16 +234,8 @@ void DrmDisplayCompositor::FrameWorker::Routine() {
     return;
   }
 
-  int wait_ret = 0;
-  if (frame_queue_.empty()) {
-    wait_ret = WaitForSignalOrExitLocked();
-  }
-
-  FrameState frame;
-  if (!frame_queue_.empty()) {
-    frame = std::move(frame_queue_.front());
-    frame_queue_.pop();
-  }
+  int wait_ret =
+      WaitForWorkOrExitLocked([this] { return !frame_queue_.empty(); });
 
   ret = Unlock();
   if (ret) {
@@ -231,7 +250,101 @@ void DrmDisplayCompositor::FrameWorker::Routine() {
     return;
   }
 
-  compositor_->ApplyFrame(std::move(frame.composition), frame.status);
+  FrameState frame;
+  if (frame_queue_.Pop(&frame))
+    compositor_->ApplyFrame(std::move(frame.composition), frame.status);
+}
+
+DrmDisplayCompositor::SquashWorker::SquashWorker(
+    DrmDisplayCompositor *compositor)
+    : Worker("squash-worker", ANDROID_PRIORITY_BACKGROUND),
+      compositor_(compositor),
+      generation_(0),
+      squashed_generation_(0),
+      frame_no_(0),
+      last_composition_ns_(0),
+      interval_ns_(0),
+      period_ns_(0),
+      waiting_(false) {
+}
+
+DrmDisplayCompositor::SquashWorker::~SquashWorker() {
+}
+
+int DrmDisplayCompositor::SquashWorker::Init() {
+  return InitWorker();
+}
+
+void DrmDisplayCompositor::SquashWorker::SetRefreshRate(float refresh_hz) {
+  if (Lock())
+    return;
+  period_ns_ = refresh_hz >= 1.0f ? 1000 * 1000 * 1000LL / refresh_hz : 0;
+  Unlock();
+}
+
+void DrmDisplayCompositor::SquashWorker::NewComposition(uint64_t frame_no) {
+  int64_t now = FrameScheduler::Now();
+  if (Lock())
+    return;
+
+  // Smoothed so that a single burst of updates doesn't reset the cadence
+  if (last_composition_ns_) {
+    int64_t interval = std::min(now - last_composition_ns_, kMaxIdleNs);
+    interval_ns_ = interval_ns_ ? (interval_ns_ * 7 + interval) / 8 : interval;
+  }
+  last_composition_ns_ = now;
+  frame_no_ = frame_no;
+  generation_++;
+
+  // A timed wait picks the new deadline up when it expires, only a worker
+  // that's waiting for good needs waking.
+  if (waiting_)
+    SignalLocked();
+  Unlock();
+}
+
+int64_t DrmDisplayCompositor::SquashWorker::IdleTimeoutLocked() const {
+  int64_t timeout = std::max(kIdleIntervals * interval_ns_,
+                             kMinIdleFrames * period_ns_);
+  return std::min(timeout, kMaxIdleNs);
+}
+
+void DrmDisplayCompositor::SquashWorker::Routine() {
+  int ret = Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+
+  // Nothing new on screen since the last squash, or nothing at all yet
+  if (squashed_generation_ == generation_) {
+    waiting_ = true;
+    int wait_ret = WaitForSignalOrExitLocked();
+    waiting_ = false;
+    Unlock();
+    if (wait_ret && wait_ret != -EINTR)
+      ALOGE("Failed to wait for signal, %d", wait_ret);
+    return;
+  }
+
+  int64_t remaining_ns =
+      last_composition_ns_ + IdleTimeoutLocked() - FrameScheduler::Now();
+  if (remaining_ns > 0) {
+    int wait_ret = WaitForSignalOrExitLocked(remaining_ns);
+    Unlock();
+    if (wait_ret && wait_ret != -EINTR && wait_ret != -ETIMEDOUT)
+      ALOGE("Failed to wait for signal, %d", wait_ret);
+    return;
+  }
+
+  uint64_t generation = generation_;
+  uint64_t frame_no = frame_no_;
+  squashed_generation_ = generation;
+  Unlock();
+
+  ret = compositor_->SquashIdle(generation, frame_no);
+  if (ret && ret != -EALREADY && ret != -ECANCELED)
+    ALOGE("Failed to squash idle display %d", ret);
 }
 
 DrmDisplayCompositor::DrmDisplayCompositor()
@@ -239,17 +352,34 @@ DrmDisplayCompositor::DrmDisplayCompositor()
       display_(-1),
       worker_(this),
       frame_worker_(this),
+      squash_worker_(this),
+      pipeline_depth_(1),
       initialized_(false),
       active_(false),
       use_hw_overlays_(true),
-      framebuffer_index_(0),
-      squash_framebuffer_index_(0),
+      mailbox_(false),
+      num_superseded_frames_(0),
+      active_composition_shown_(false),
+      num_skipped_commits_(0),
+      gl_service_(NULL),
+      squash_framebuffer_(NULL),
+      squash_frame_(0, 0, 0, 0),
+      squash_format_(PIXEL_FORMAT_RGBA_8888),
+      deferred_squash_num_layers_(0),
+      late_latch_(false),
+      deadline_strategy_(false),
+      test_cache_enabled_(false),
+      nonblocking_commit_(false),
+      commit_group_(NULL),
+      flip_pending_(false),
       dump_frames_composited_(0),
       dump_last_timestamp_ns_(0) {
   struct timespec ts;
   if (clock_gettime(CLOCK_MONOTONIC, &ts))
     return;
   dump_last_timestamp_ns_ = ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+  for (int i = 0; i < kNumFrameStrategies; i++)
+    num_strategy_frames_[i] = 0;
 }
 
 DrmDisplayCompositor::~DrmDisplayCompositor() {
@@ -257,7 +387,13 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     return;
 
   worker_.Exit();
+  squash_worker_.Exit();
   frame_worker_.Exit();
+  framebuffer_allocator_.Exit();
+
+  // The flip handler refers back to us
+  WaitForPendingFlip();
+  retiring_composition_.reset();
 
   int ret = pthread_mutex_lock(&lock_);
   if (ret)
@@ -268,10 +404,8 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
   if (mode_.old_blob_id)
     drm_->DestroyPropertyBlob(mode_.old_blob_id);
 
-  while (!composite_queue_.empty()) {
-    composite_queue_.front().reset();
-    composite_queue_.pop();
-  }
+  composite_queue_.Clear();
+  mailbox_frame_.reset();
   active_composition_.reset();
 
   ret = pthread_mutex_unlock(&lock_);
@@ -279,6 +413,9 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     ALOGE("Failed to acquire compositor lock %d", ret);
 
   pthread_mutex_destroy(&lock_);
+  pthread_mutex_destroy(&mailbox_lock_);
+  pthread_cond_destroy(&flip_cond_);
+  pthread_mutex_destroy(&flip_lock_);
 }
 
 int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
@@ -290,20 +427,130 @@ int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
     ALOGE("Failed to initialize drm compositor lock %d\n", ret);
     return ret;
   }
-  ret = worker_.Init();
+  ret = pthread_mutex_init(&mailbox_lock_, NULL);
   if (ret) {
     pthread_mutex_destroy(&lock_);
-    ALOGE("Failed to initialize compositor worker %d\n", ret);
+    ALOGE("Failed to initialize mailbox lock %d\n", ret);
+    return ret;
+  }
+  ret = pthread_mutex_init(&flip_lock_, NULL);
+  if (ret) {
+    pthread_mutex_destroy(&mailbox_lock_);
+    pthread_mutex_destroy(&lock_);
+    ALOGE("Failed to initialize flip lock %d\n", ret);
     return ret;
   }
-  ret = frame_worker_.Init();
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  ret = pthread_cond_init(&flip_cond_, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
   if (ret) {
+    pthread_mutex_destroy(&flip_lock_);
+    pthread_mutex_destroy(&mailbox_lock_);
     pthread_mutex_destroy(&lock_);
+    ALOGE("Failed to initialize flip condition %d\n", ret);
+    return ret;
+  }
+  // From here on a failure is cleaned up by the destructor, including the
+  // workers that were already started.
+  initialized_ = true;
+
+  char key[PROPERTY_KEY_MAX];
+  char value[PROPERTY_VALUE_MAX];
+  snprintf(key, sizeof(key), "hwc.drm.display%d.queue_depth", display);
+  property_get(key, value, "");
+  int queue_depth = atoi(value);
+  if (queue_depth <= 0)
+    queue_depth = DRM_DISPLAY_COMPOSITOR_MAX_QUEUE_DEPTH;
+  ret = composite_queue_.Init(queue_depth);
+  if (ret) {
+    ALOGE("Failed to initialize composite queue %d\n", ret);
+    return ret;
+  }
+
+  snprintf(key, sizeof(key), "hwc.drm.display%d.mailbox", display);
+  property_get(key, value, "0");
+  mailbox_ = atoi(value) != 0;
+
+  ret = scheduler_.Init();
+  if (ret)
+    return ret;
+  ret = vsync_model_.Init();
+  if (ret)
+    return ret;
+  scheduler_.SetVSyncModel(&vsync_model_);
+  property_get("hwc.drm.late_latch", value, "0");
+  late_latch_ = atoi(value) != 0;
+  property_get("hwc.drm.late_latch_margin_us", value, "1000");
+  scheduler_.SetMargin(atoll(value) * 1000);
+  // A display with a latch phase of its own latches late regardless
+  snprintf(key, sizeof(key), "hwc.drm.display%d.latch_phase_us", display);
+  property_get(key, value, "0");
+  int64_t latch_phase_ns = atoll(value) * 1000;
+  scheduler_.SetLatchPhase(latch_phase_ns);
+  if (latch_phase_ns)
+    late_latch_ = true;
+  property_get("hwc.drm.deadline_strategy", value, "0");
+  deadline_strategy_ = atoi(value) != 0;
+  ret = test_cache_.Init();
+  if (ret)
+    return ret;
+  property_get("hwc.drm.test_cache", value, "1");
+  test_cache_enabled_ = atoi(value) != 0;
+  DrmConnector *connector = drm_->GetConnectorForDisplay(display_);
+  if (connector) {
+    scheduler_.SetRefreshRate(connector->active_mode().v_refresh());
+    vsync_model_.Reset(connector->active_mode().frame_period_ns());
+  }
+
+  char nonblocking_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.nonblocking_commit", nonblocking_opt, "1");
+  nonblocking_commit_ = atoi(nonblocking_opt) != 0;
+
+  // Test commits are made while earlier frames may still be on their way to
+  // the kernel, so they can't assume what it holds and carry the full state.
+  ret = test_request_.Init(NULL);
+  if (!ret)
+    ret = commit_request_.Init(drm_->property_shadow());
+  if (ret)
+    return ret;
+
+  ret = worker_.Init();
+  if (ret) {
+    ALOGE("Failed to initialize compositor worker %d\n", ret);
+    return ret;
+  }
+  property_get("hwc.drm.pipeline_depth", value, "1");
+  pipeline_depth_ = std::min(std::max(atoi(value), 1), DRM_DISPLAY_BUFFERS);
+  // One frame is with the frame worker, the others wait in its queue
+  ret = frame_worker_.Init(pipeline_depth_ > 1 ? pipeline_depth_ - 1
+                                               : kMaxFrameQueueDepth);
+  if (ret) {
     ALOGE("Failed to initialize frame worker %d\n", ret);
     return ret;
   }
+  ret = squash_worker_.Init();
+  if (ret) {
+    ALOGE("Failed to initialize squash worker %d\n", ret);
+    return ret;
+  }
+  if (connector)
+    squash_worker_.SetRefreshRate(connector->active_mode().v_refresh());
+  ret = framebuffer_allocator_.Init();
+  if (ret) {
+    ALOGE("Failed to initialize framebuffer allocator %d\n", ret);
+    return ret;
+  }
+  for (int i = 0; i < DRM_DISPLAY_BUFFER_FORMATS; i++) {
+    ret = framebuffer_pools_[i].Init(kFramebufferFormats[i],
+                                     DRM_DISPLAY_POOL_BUFFERS);
+    if (ret) {
+      ALOGE("Failed to initialize framebuffer pool %d\n", ret);
+      return ret;
+    }
+  }
 
-  initialized_ = true;
   return 0;
 }
 
@@ -335,32 +582,153 @@ int DrmDisplayCompositor::QueueComposition(
       return -ENOENT;
   }
 
-  int ret = pthread_mutex_lock(&lock_);
+  // Frames that carry squash regions are never superseded since later frames
+  // may scan out the squash buffer they render.
+  if (mailbox_ && composition->type() == DRM_COMPOSITION_TYPE_FRAME &&
+      composition->squash_regions().empty())
+    return QueueMailboxFrame(std::move(composition));
+
+  // Block the queue if it gets too large. Otherwise, SurfaceFlinger will start
+  // to eat our buffer handles when we get about 1 second behind. Frames give
+  // up after a while, but DPMS and modeset requests must not be lost.
+  int64_t timeout_ns = composition->type() == DRM_COMPOSITION_TYPE_FRAME
+                           ? DRM_DISPLAY_COMPOSITOR_QUEUE_TIMEOUT_NS
+                           : -1;
+  int ret = composite_queue_.Push(std::move(composition), timeout_ns);
   if (ret) {
-    ALOGE("Failed to acquire compositor lock %d", ret);
+    ALOGE("Failed to queue composition for display %d %d", display_, ret);
     return ret;
   }
 
-  // Block the queue if it gets too large. Otherwise, SurfaceFlinger will start
-  // to eat our buffer handles when we get about 1 second behind.
-  while (composite_queue_.size() >= DRM_DISPLAY_COMPOSITOR_MAX_QUEUE_DEPTH) {
-    pthread_mutex_unlock(&lock_);
-    sched_yield();
-    pthread_mutex_lock(&lock_);
+  worker_.SignalIfIdle();
+  return 0;
+}
+
+// Only the newest frame can make it to the next vblank, so there is no point
+// in committing older ones that are still waiting. Superseded frames are
+// destroyed right away, which signals their release fences.
+int DrmDisplayCompositor::QueueMailboxFrame(
+    std::unique_ptr<DrmDisplayComposition> composition) {
+  std::unique_ptr<DrmDisplayComposition> superseded;
+
+  int ret = pthread_mutex_lock(&mailbox_lock_);
+  if (ret) {
+    ALOGE("Failed to acquire mailbox lock %d", ret);
+    return ret;
   }
 
-  composite_queue_.push(std::move(composition));
+  superseded = std::move(mailbox_frame_);
+  if (superseded) {
+    // The test commit for the new geometry still has to happen.
+    if (superseded->geometry_changed())
+      composition->set_geometry_changed(true);
+    num_superseded_frames_++;
+  }
+  mailbox_frame_ = std::move(composition);
 
-  ret = pthread_mutex_unlock(&lock_);
+  ret = pthread_mutex_unlock(&mailbox_lock_);
   if (ret) {
-    ALOGE("Failed to release compositor lock %d", ret);
+    ALOGE("Failed to release mailbox lock %d", ret);
     return ret;
   }
 
-  worker_.Signal();
+  if (superseded)
+    DropFrame(std::move(superseded));
+  worker_.SignalIfIdle();
   return 0;
 }
 
+std::unique_ptr<DrmDisplayComposition>
+DrmDisplayCompositor::TakeNextComposition() {
+  std::unique_ptr<DrmDisplayComposition> composition;
+  if (mailbox_) {
+    AutoLock lock(&mailbox_lock_, "mailbox");
+    if (lock.Lock())
+      return NULL;
+    std::unique_ptr<DrmDisplayComposition> *front = composite_queue_.Front();
+    if (mailbox_frame_ &&
+        (!front || mailbox_frame_->frame_no() < (*front)->frame_no()))
+      return std::move(mailbox_frame_);
+  }
+
+  composite_queue_.Pop(&composition);
+  return composition;
+}
+
+// Like TakeNextComposition(), but leaves anything other than a frame queued.
+std::unique_ptr<DrmDisplayComposition> DrmDisplayCompositor::TakeNextFrame() {
+  std::unique_ptr<DrmDisplayComposition> composition;
+  if (mailbox_) {
+    AutoLock lock(&mailbox_lock_, "mailbox");
+    if (lock.Lock())
+      return NULL;
+    std::unique_ptr<DrmDisplayComposition> *front = composite_queue_.Front();
+    if (mailbox_frame_ &&
+        (!front || mailbox_frame_->frame_no() < (*front)->frame_no()))
+      return std::move(mailbox_frame_);
+  }
+
+  std::unique_ptr<DrmDisplayComposition> *front = composite_queue_.Front();
+  if (front && (*front)->type() == DRM_COMPOSITION_TYPE_FRAME)
+    composite_queue_.Pop(&composition);
+  return composition;
+}
+
+DrmCompositionType DrmDisplayCompositor::PeekNextCompositionType() {
+  if (mailbox_) {
+    AutoLock lock(&mailbox_lock_, "mailbox");
+    if (lock.Lock())
+      return DRM_COMPOSITION_TYPE_EMPTY;
+    std::unique_ptr<DrmDisplayComposition> *front = composite_queue_.Front();
+    if (mailbox_frame_ &&
+        (!front || mailbox_frame_->frame_no() < (*front)->frame_no()))
+      return mailbox_frame_->type();
+  }
+  std::unique_ptr<DrmDisplayComposition> *front = composite_queue_.Front();
+  return front ? (*front)->type() : DRM_COMPOSITION_TYPE_EMPTY;
+}
+
+// Replaces |frame| with the frame queued right behind it, if there is one.
+// The skipped frame is destroyed, which signals its release fences.
+bool DrmDisplayCompositor::SkipToNextFrame(
+    std::unique_ptr<DrmDisplayComposition> *frame) {
+  std::unique_ptr<DrmDisplayComposition> newer = TakeNextFrame();
+  if (!newer)
+    return false;
+
+  // The test commit for the new geometry still has to happen.
+  if ((*frame)->geometry_changed())
+    newer->set_geometry_changed(true);
+  num_superseded_frames_++;
+  DropFrame(std::move(*frame));
+  *frame = std::move(newer);
+  return true;
+}
+
+// Destroys a frame that won't be committed, which signals its release fences.
+// Displays that were going to commit the same frame together with this one
+// stop waiting for it.
+void DrmDisplayCompositor::DropFrame(
+    std::unique_ptr<DrmDisplayComposition> frame) {
+  if (commit_group_ && frame->type() == DRM_COMPOSITION_TYPE_FRAME)
+    commit_group_->Withdraw(frame->frame_no());
+}
+
+// With |newest_frame| a frame that is directly followed by another one is
+// skipped, the same way the mailbox replaces it. Frames that render squash
+// regions are kept since later frames may scan out their squash buffer.
+std::unique_ptr<DrmDisplayComposition>
+DrmDisplayCompositor::DequeueComposition(bool newest_frame) {
+  std::unique_ptr<DrmDisplayComposition> composition = TakeNextComposition();
+  while (newest_frame && composition &&
+         composition->type() == DRM_COMPOSITION_TYPE_FRAME &&
+         composition->squash_regions().empty()) {
+    if (!SkipToNextFrame(&composition))
+      break;
+  }
+  return composition;
+}
+
 std::tuple<uint32_t, uint32_t, int>
 DrmDisplayCompositor::GetActiveModeResolution() {
   DrmConnector *connector = drm_->GetConnectorForDisplay(display_);
@@ -374,15 +742,168 @@ DrmDisplayCompositor::GetActiveModeResolution() {
   return std::make_tuple(mode.h_display(), mode.v_display(), 0);
 }
 
-int DrmDisplayCompositor::PrepareFramebuffer(
-    DrmFramebuffer &fb, DrmDisplayComposition *display_comp) {
-  int ret = fb.WaitReleased(-1);
+int DrmDisplayCompositor::CreatePreCompositor(
+    bool idle, std::unique_ptr<PreCompositor> *compositor) {
+  char use_cpu_compositor_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.use_cpu_compositor", use_cpu_compositor_opt, "0");
+  int ret;
+
+  if (!atoi(use_cpu_compositor_opt)) {
+    if (gl_service_) {
+      if (idle)
+        compositor->reset(new SharedGLCompositor(
+            gl_service_, GLCompositorService::kIdlePriority, NULL));
+      else
+        compositor->reset(
+            new SharedGLCompositor(gl_service_, display_, &scheduler_));
+    } else {
+      compositor->reset(new GLWorkerCompositor());
+    }
+    ret = (*compositor)->Init();
+    if (!ret)
+      return 0;
+    ALOGW("Failed to initialize OpenGL compositor %d, using the CPU instead",
+          ret);
+  }
+
+  compositor->reset(new CpuCompositor());
+  ret = (*compositor)->Init();
   if (ret) {
-    ALOGE("Failed to wait for framebuffer release %d", ret);
-    return ret;
+    ALOGE("Failed to initialize CPU compositor %d", ret);
+    compositor->reset();
   }
+  return ret;
+}
+
+static int AlignFramebufferSize(int size, int align, int max) {
+  return std::min((size + align - 1) / align * align, max);
+}
+
+DrmHwcRect<int> DrmDisplayCompositor::GetFramebufferFrame(
+    DrmDisplayComposition *display_comp,
+    const std::vector<DrmCompositionRegion> &regions, size_t source) {
   uint32_t width, height;
+  int ret;
   std::tie(width, height, ret) = GetActiveModeResolution();
+  if (ret)
+    return DrmHwcRect<int>(0, 0, 0, 0);
+  DrmHwcRect<int> full(0, 0, width, height);
+
+  char shrink_framebuffers_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.shrink_framebuffers", shrink_framebuffers_opt, "1");
+  if (!atoi(shrink_framebuffers_opt) || regions.empty())
+    return full;
+
+  // Many drivers require the primary plane to span the whole crtc, so only
+  // shrink framebuffers that end up on an overlay.
+  for (const DrmCompositionPlane &comp_plane :
+       display_comp->composition_planes()) {
+    if (comp_plane.source_layer == source &&
+        comp_plane.plane->type() == DRM_PLANE_TYPE_PRIMARY)
+      return full;
+  }
+
+  DrmHwcRect<int> frame = regions[0].frame;
+  for (const DrmCompositionRegion &region : regions) {
+    frame.left = std::min(frame.left, region.frame.left);
+    frame.top = std::min(frame.top, region.frame.top);
+    frame.right = std::max(frame.right, region.frame.right);
+    frame.bottom = std::max(frame.bottom, region.frame.bottom);
+  }
+  frame.left = std::max(frame.left, full.left);
+  frame.top = std::max(frame.top, full.top);
+  frame.right = std::min(frame.right, full.right);
+  frame.bottom = std::min(frame.bottom, full.bottom);
+  if (frame.width() <= 0 || frame.height() <= 0)
+    return full;
+
+  return frame;
+}
+
+static bool IsOpaqueFormat(uint32_t format) {
+  return format != DRM_FORMAT_ABGR8888 && format != DRM_FORMAT_ARGB8888;
+}
+
+// Returns true if every pixel of |region| is covered by an opaque layer.
+static bool IsOpaqueRegion(const std::vector<DrmHwcLayer> &layers,
+                           const DrmCompositionRegion &region) {
+  for (size_t layer_index : region.source_layers) {
+    const DrmHwcLayer &layer = layers[layer_index];
+    if (layer.blending == DrmHwcBlending::kNone)
+      return true;
+    if (layer.alpha == 0xff && layer.buffer &&
+        IsOpaqueFormat(layer.buffer->format))
+      return true;
+  }
+  return false;
+}
+
+DrmFramebufferPool &DrmDisplayCompositor::GetFramebufferPool(
+    PixelFormat format) {
+  for (int i = 0; i < DRM_DISPLAY_BUFFER_FORMATS; i++)
+    if (kFramebufferFormats[i] == format)
+      return framebuffer_pools_[i];
+  return framebuffer_pools_[0];
+}
+
+void DrmDisplayCompositor::QueueFramebufferPreallocation(const DrmMode &mode) {
+  // Full screen buffers fit every frame, so they serve until buffers of the
+  // frame's size are allocated in the background, see PrepareFramebuffer().
+  // Pools of the other formats still get oversized buffers retired.
+  for (int i = 0; i < DRM_DISPLAY_BUFFER_FORMATS; i++)
+    framebuffer_allocator_.QueuePreallocate(
+        &framebuffer_pools_[i], mode.h_display(), mode.v_display(),
+        pre_compositor_ ? pre_compositor_->framebuffer_usage() : 0,
+        kFramebufferFormats[i] == PIXEL_FORMAT_RGBA_8888
+            ? DRM_DISPLAY_PREALLOCATED_BUFFERS
+            : 0,
+        true);
+}
+
+// Alpha is only needed in the intermediate buffer if something below it can
+// show through. That's not the case when the regions tile the framebuffer's
+// frame and each of them is opaque, so an alpha-less format can be used,
+// which saves scanout and fill bandwidth.
+PixelFormat DrmDisplayCompositor::GetFramebufferFormat(
+    const std::vector<DrmHwcLayer> &layers,
+    const std::vector<DrmCompositionRegion> &regions,
+    const DrmHwcRect<int> &frame) const {
+  char opaque_format_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.opaque_framebuffer_format", opaque_format_opt,
+               "rgbx");
+  PixelFormat opaque_format;
+  if (!strcmp(opaque_format_opt, "rgbx"))
+    opaque_format = PIXEL_FORMAT_RGBX_8888;
+  else if (!strcmp(opaque_format_opt, "rgb565"))
+    opaque_format = PIXEL_FORMAT_RGB_565;
+  else
+    return PIXEL_FORMAT_RGBA_8888;
+
+  int64_t covered_area = 0;
+  for (const DrmCompositionRegion &region : regions) {
+    if (!IsOpaqueRegion(layers, region))
+      return PIXEL_FORMAT_RGBA_8888;
+    int left = std::max(region.frame.left, frame.left);
+    int top = std::max(region.frame.top, frame.top);
+    int right = std::min(region.frame.right, frame.right);
+    int bottom = std::min(region.frame.bottom, frame.bottom);
+    if (right > left && bottom > top)
+      covered_area += (int64_t)(right - left) * (bottom - top);
+  }
+
+  // Regions never overlap, so they tile the frame iff their areas add up.
+  if (covered_area != (int64_t)frame.width() * frame.height())
+    return PIXEL_FORMAT_RGBA_8888;
+
+  return opaque_format;
+}
+
+int DrmDisplayCompositor::PrepareFramebuffer(
+    DrmDisplayComposition *display_comp, PreCompositor *pre_compositor,
+    const DrmHwcRect<int> &frame, PixelFormat format, DrmFramebuffer **fb_out) {
+  uint32_t mode_width, mode_height;
+  int ret;
+  std::tie(mode_width, mode_height, ret) = GetActiveModeResolution();
   if (ret) {
     ALOGE(
         "Failed to allocate framebuffer because the display resolution could "
@@ -391,128 +912,273 @@ int DrmDisplayCompositor::PrepareFramebuffer(
     return ret;
   }
 
-  fb.set_release_fence_fd(-1);
-  if (!fb.Allocate(width, height)) {
-    ALOGE("Failed to allocate framebuffer with size %dx%d", width, height);
+  if (frame.width() <= 0 || frame.height() <= 0) {
+    ALOGE("Invalid framebuffer frame %dx%d", frame.width(), frame.height());
+    return -EINVAL;
+  }
+
+  uint32_t width = AlignFramebufferSize(frame.width(), kFramebufferSizeAlign,
+                                        mode_width);
+  uint32_t height = AlignFramebufferSize(frame.height(),
+                                         kFramebufferSizeAlign, mode_height);
+
+  DrmFramebufferPool &pool = GetFramebufferPool(format);
+  // The buffer has to suit whichever compositor renders into it
+  uint32_t usage = pre_compositor->framebuffer_usage();
+  DrmFramebuffer *fb = pool.Get(width, height, usage);
+  if (!fb) {
+    ALOGE("Failed to get framebuffer with size %dx%d", width, height);
     return -ENOMEM;
   }
+  // A larger buffer does for now, one that fits is allocated in the background
+  // if the pool has room for it.
+  if ((fb->buffer()->getWidth() != width ||
+       fb->buffer()->getHeight() != height) &&
+      !pool.IsFull())
+    framebuffer_allocator_.QueuePreallocate(&pool, width, height, usage, 1,
+                                            false);
 
   display_comp->layers().emplace_back();
   DrmHwcLayer &pre_comp_layer = display_comp->layers().back();
-  pre_comp_layer.sf_handle = fb.buffer()->handle;
-  pre_comp_layer.blending = DrmHwcBlending::kPreMult;
-  pre_comp_layer.source_crop = DrmHwcRect<float>(0, 0, width, height);
-  pre_comp_layer.display_frame = DrmHwcRect<int>(0, 0, width, height);
-  ret = pre_comp_layer.buffer.ImportBuffer(fb.buffer()->handle,
+  pre_comp_layer.sf_handle = fb->buffer()->handle;
+  pre_comp_layer.blending = format == PIXEL_FORMAT_RGBA_8888
+                                ? DrmHwcBlending::kPreMult
+                                : DrmHwcBlending::kNone;
+  pre_comp_layer.source_crop =
+      DrmHwcRect<float>(0, 0, frame.width(), frame.height());
+  pre_comp_layer.display_frame = frame;
+  ret = pre_comp_layer.buffer.ImportBuffer(fb->buffer()->handle,
                                            display_comp->importer());
   if (ret) {
     ALOGE("Failed to import framebuffer for display %d", ret);
+    pool.Put(fb, -1);
     return ret;
   }
 
+  *fb_out = fb;
   return ret;
 }
 
+// Completes the rendering just issued to |pre_compositor|. When frames are
+// pipelined the compositor moves on to the next frame right away and the frame
+// worker waits for the rendering instead, see ApplyFrame(). Returns false in
+// that case.
+bool DrmDisplayCompositor::SubmitRender(PreCompositor *pre_compositor,
+                                        DrmDisplayComposition *display_comp) {
+  if (pipeline_depth_ <= 1) {
+    pre_compositor->Finish();
+    return true;
+  }
+
+  int fence = pre_compositor->Flush();
+  if (fence < 0)
+    return true;
+  if (display_comp->AddRenderFence(fence)) {
+    pre_compositor->Finish();
+    return true;
+  }
+  return false;
+}
+
 int DrmDisplayCompositor::ApplySquash(DrmDisplayComposition *display_comp) {
   int ret = 0;
 
-  DrmFramebuffer &fb = squash_framebuffers_[squash_framebuffer_index_];
-  ret = PrepareFramebuffer(fb, display_comp);
+  std::vector<DrmCompositionRegion> &regions = display_comp->squash_regions();
+  DrmHwcRect<int> frame = GetFramebufferFrame(
+      display_comp, regions, DrmCompositionPlane::kSourceSquash);
+  PixelFormat format =
+      GetFramebufferFormat(display_comp->layers(), regions, frame);
+  DrmFramebufferPool &pool = GetFramebufferPool(format);
+  DrmFramebuffer *fb;
+  ret = PrepareFramebuffer(display_comp, pre_compositor_.get(), frame, format,
+                           &fb);
   if (ret) {
     ALOGE("Failed to prepare framebuffer for squash %d", ret);
     return ret;
   }
 
-  std::vector<DrmCompositionRegion> &regions = display_comp->squash_regions();
+  int64_t start_ns = FrameScheduler::Now();
   ret = pre_compositor_->Composite(display_comp->layers().data(),
-                                   regions.data(), regions.size(), fb.buffer());
-  pre_compositor_->Finish();
+                                   regions.data(), regions.size(), fb->buffer(),
+                                   frame);
+  bool render_done = SubmitRender(pre_compositor_.get(), display_comp);
+  scheduler_.RecordStage(FrameScheduler::kStageSquash,
+                         FrameScheduler::Now() - start_ns);
 
   if (ret) {
     ALOGE("Failed to squash layers");
+    pool.Put(fb, -1);
     return ret;
   }
 
   ret = display_comp->CreateNextTimelineFence();
   if (ret <= 0) {
     ALOGE("Failed to create squash framebuffer release fence %d", ret);
+    pool.Put(fb, -1);
     return ret;
   }
 
-  fb.set_release_fence_fd(ret);
-  display_comp->SignalSquashDone();
+  pool.Put(fb, ret);
+  if (squash_framebuffer_)
+    GetFramebufferPool(squash_format_).Pin(squash_framebuffer_, false);
+  pool.Pin(fb, true);
+  squash_framebuffer_ = fb;
+  squash_frame_ = frame;
+  squash_format_ = format;
+  if (render_done)
+    display_comp->SignalSquashDone();
 
   return 0;
 }
 
-int DrmDisplayCompositor::ApplyPreComposite(
-    DrmDisplayComposition *display_comp) {
+int DrmDisplayCompositor::ApplyPreComposite(DrmDisplayComposition *display_comp,
+                                            PreCompositor *pre_compositor) {
   int ret = 0;
 
-  DrmFramebuffer &fb = framebuffers_[framebuffer_index_];
-  ret = PrepareFramebuffer(fb, display_comp);
+  std::vector<DrmCompositionRegion> &regions = display_comp->pre_comp_regions();
+  DrmHwcRect<int> frame = GetFramebufferFrame(
+      display_comp, regions, DrmCompositionPlane::kSourcePreComp);
+  PixelFormat format =
+      GetFramebufferFormat(display_comp->layers(), regions, frame);
+  DrmFramebufferPool &pool = GetFramebufferPool(format);
+  DrmFramebuffer *fb;
+  ret = PrepareFramebuffer(display_comp, pre_compositor, frame, format, &fb);
   if (ret) {
     ALOGE("Failed to prepare framebuffer for pre-composite %d", ret);
     return ret;
   }
 
-  std::vector<DrmCompositionRegion> &regions = display_comp->pre_comp_regions();
-  ret = pre_compositor_->Composite(display_comp->layers().data(),
-                                   regions.data(), regions.size(), fb.buffer());
-  pre_compositor_->Finish();
+  int64_t start_ns = FrameScheduler::Now();
+  ret = pre_compositor->Composite(display_comp->layers().data(), regions.data(),
+                                  regions.size(), fb->buffer(), frame);
+  bool render_done = SubmitRender(pre_compositor, display_comp);
+  // Idle squashes run at low priority and would skew the frame estimates
+  if (pre_compositor == pre_compositor_.get())
+    scheduler_.RecordStage(FrameScheduler::kStagePreComp,
+                           FrameScheduler::Now() - start_ns);
 
   if (ret) {
     ALOGE("Failed to pre-composite layers");
+    pool.Put(fb, -1);
     return ret;
   }
 
   ret = display_comp->CreateNextTimelineFence();
   if (ret <= 0) {
     ALOGE("Failed to create pre-composite framebuffer release fence %d", ret);
+    pool.Put(fb, -1);
     return ret;
   }
 
-  fb.set_release_fence_fd(ret);
-  display_comp->SignalPreCompDone();
+  pool.Put(fb, ret);
+  if (render_done)
+    display_comp->SignalPreCompDone();
 
   return 0;
 }
 
 int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
-  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
-  if (!pset) {
-    ALOGE("Failed to allocate property set");
-    return -ENOMEM;
-  }
+  // Forced, after a failed commit the shadow may not match what's on screen
+  DrmAtomicRequest &request = commit_request_;
+  request.Reset();
 
   int ret;
   std::vector<DrmCompositionPlane> &comp_planes =
       display_comp->composition_planes();
   for (DrmCompositionPlane &comp_plane : comp_planes) {
     DrmPlane *plane = comp_plane.plane;
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), 0) < 0 ||
-          drmModeAtomicAddProperty(pset, plane->id(), plane->fb_property().id(),
-                                   0) < 0;
+    ret = request.ForceProperty(plane->id(), plane->crtc_property().id(), 0,
+                                true) < 0 ||
+          request.ForceProperty(plane->id(), plane->fb_property().id(), 0,
+                                true) < 0;
     if (ret) {
       ALOGE("Failed to add plane %d disable to pset", plane->id());
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
 
-  ret = drmModeAtomicCommit(drm_->fd(), pset, 0, drm_);
+  ret = drmModeAtomicCommit(drm_->fd(), request.get(), 0, drm_);
   if (ret) {
     ALOGE("Failed to commit pset ret=%d\n", ret);
-    drmModeAtomicFree(pset);
     return ret;
   }
 
-  drmModeAtomicFree(pset);
+  request.Committed();
   return 0;
 }
 
-int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
+// Picks the cheapest way to get |display_comp| ready that still fits in the
+// time left before its vblank, using how long the GL passes took recently.
+// Until there's enough history to go by every frame gets the full treatment.
+DrmDisplayCompositor::FrameStrategy DrmDisplayCompositor::SelectFrameStrategy(
+    DrmDisplayComposition *display_comp) {
+  if (!deadline_strategy_)
+    return kStrategyFull;
+
+  int64_t time_left_ns;
+  if (!scheduler_.TimeLeft(FrameScheduler::Now(), &time_left_ns))
+    return kStrategyFull;
+
+  bool render_squash = !display_comp->squash_regions().empty();
+  int64_t squash_ns =
+      render_squash ? scheduler_.Estimate(FrameScheduler::kStageSquash) : 0;
+  int64_t pre_comp_ns =
+      display_comp->pre_comp_regions().empty()
+          ? 0
+          : scheduler_.Estimate(FrameScheduler::kStagePreComp);
+  if (squash_ns + pre_comp_ns <= time_left_ns)
+    return kStrategyFull;
+
+  // A squash buffer that this frame doesn't scan out can be rendered later
+  if (render_squash && !UsesSquash(display_comp->composition_planes()) &&
+      pre_comp_ns <= time_left_ns)
+    return kStrategyDeferSquash;
+
+  // Rather than put a late frame on screen a vblank after it was due, keep
+  // the previous one there and move on to the newer frame. The squash buffer
+  // a frame renders may be needed later, so such frames are never skipped.
+  if (!render_squash &&
+      PeekNextCompositionType() == DRM_COMPOSITION_TYPE_FRAME)
+    return kStrategyPresentPrevious;
+
+  return kStrategyMergeRegions;
+}
+
+// Joins regions that blend the same layers and together form a rectangle.
+// Every one of those layers covers both regions, so the result looks the same
+// but takes fewer draws.
+static void MergeRegions(std::vector<DrmCompositionRegion> *regions) {
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < regions->size() && !merged; i++) {
+      for (size_t j = i + 1; j < regions->size() && !merged; j++) {
+        DrmCompositionRegion &a = (*regions)[i];
+        const DrmCompositionRegion &b = (*regions)[j];
+        if (a.source_layers != b.source_layers)
+          continue;
+
+        const DrmHwcRect<int> &af = a.frame;
+        const DrmHwcRect<int> &bf = b.frame;
+        bool same_rows = af.top == bf.top && af.bottom == bf.bottom &&
+                         (af.right == bf.left || bf.right == af.left);
+        bool same_columns = af.left == bf.left && af.right == bf.right &&
+                            (af.bottom == bf.top || bf.bottom == af.top);
+        if (!same_rows && !same_columns)
+          continue;
+
+        a.frame = DrmHwcRect<int>(
+            std::min(af.left, bf.left), std::min(af.top, bf.top),
+            std::max(af.right, bf.right), std::max(af.bottom, bf.bottom));
+        regions->erase(regions->begin() + j);
+        merged = true;
+      }
+    }
+  }
+}
+
+int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp,
+                                       FrameStrategy strategy) {
   int ret = 0;
 
   std::vector<DrmHwcLayer> &layers = display_comp->layers();
@@ -523,9 +1189,33 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
   std::vector<DrmCompositionRegion> &pre_comp_regions =
       display_comp->pre_comp_regions();
 
+  // A deferred squash render is picked up by the first frame that scans out
+  // the squash buffer, or that has time to spare. Squash state only carries
+  // over while the geometry stays the same, so the layer indices in the
+  // regions still refer to the same layers.
+  if (display_comp->geometry_changed() || !squash_regions.empty() ||
+      layers.size() != deferred_squash_num_layers_) {
+    deferred_squash_regions_.clear();
+  } else if (!deferred_squash_regions_.empty() &&
+             (strategy == kStrategyFull || UsesSquash(comp_planes))) {
+    squash_regions = std::move(deferred_squash_regions_);
+    deferred_squash_regions_.clear();
+  }
+
+  if (!squash_regions.empty() && strategy >= kStrategyDeferSquash &&
+      !UsesSquash(comp_planes)) {
+    deferred_squash_regions_ = std::move(squash_regions);
+    deferred_squash_num_layers_ = layers.size();
+    squash_regions.clear();
+    // Nothing in this frame waits on the squash render anymore
+    display_comp->SignalSquashDone();
+  }
+
+  if (strategy >= kStrategyMergeRegions)
+    MergeRegions(&pre_comp_regions);
+
   int squash_layer_index = -1;
   if (squash_regions.size() > 0) {
-    squash_framebuffer_index_ = (squash_framebuffer_index_ + 1) % 2;
     ret = ApplySquash(display_comp);
     if (ret)
       return ret;
@@ -533,22 +1223,27 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
     squash_layer_index = layers.size() - 1;
   } else {
     if (UsesSquash(comp_planes)) {
-      DrmFramebuffer &fb = squash_framebuffers_[squash_framebuffer_index_];
+      DrmFramebuffer *fb = squash_framebuffer_;
+      if (!fb) {
+        ALOGE("Squash layer requested with no squashed framebuffer");
+        return -EINVAL;
+      }
       layers.emplace_back();
       squash_layer_index = layers.size() - 1;
       DrmHwcLayer &squash_layer = layers.back();
-      ret = squash_layer.buffer.ImportBuffer(fb.buffer()->handle,
+      ret = squash_layer.buffer.ImportBuffer(fb->buffer()->handle,
                                              display_comp->importer());
       if (ret) {
         ALOGE("Failed to import old squashed framebuffer %d", ret);
         return ret;
       }
-      squash_layer.sf_handle = fb.buffer()->handle;
-      squash_layer.blending = DrmHwcBlending::kPreMult;
+      squash_layer.sf_handle = fb->buffer()->handle;
+      squash_layer.blending = squash_format_ == PIXEL_FORMAT_RGBA_8888
+                                  ? DrmHwcBlending::kPreMult
+                                  : DrmHwcBlending::kNone;
       squash_layer.source_crop = DrmHwcRect<float>(
-          0, 0, squash_layer.buffer->width, squash_layer.buffer->height);
-      squash_layer.display_frame = DrmHwcRect<int>(
-          0, 0, squash_layer.buffer->width, squash_layer.buffer->height);
+          0, 0, squash_frame_.width(), squash_frame_.height());
+      squash_layer.display_frame = squash_frame_;
       ret = display_comp->CreateNextTimelineFence();
 
       if (ret <= 0) {
@@ -556,7 +1251,7 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
         return ret;
       }
 
-      fb.set_release_fence_fd(ret);
+      GetFramebufferPool(squash_format_).SetReleaseFence(fb, ret);
       ret = 0;
     }
   }
@@ -564,12 +1259,11 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
   bool do_pre_comp = pre_comp_regions.size() > 0;
   int pre_comp_layer_index = -1;
   if (do_pre_comp) {
-    ret = ApplyPreComposite(display_comp);
+    ret = ApplyPreComposite(display_comp, pre_compositor_.get());
     if (ret)
       return ret;
 
     pre_comp_layer_index = layers.size() - 1;
-    framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
   }
 
   for (DrmCompositionPlane &comp_plane : comp_planes) {
@@ -594,6 +1288,68 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
   return ret;
 }
 
+class FlipCompleteHandler : public DrmEventHandler {
+ public:
+  FlipCompleteHandler(DrmDisplayCompositor *compositor)
+      : compositor_(compositor) {
+  }
+
+  void HandleEvent(uint64_t timestamp_us) override {
+    compositor_->FlipComplete(timestamp_us);
+  }
+
+ private:
+  DrmDisplayCompositor *compositor_;
+};
+
+void DrmDisplayCompositor::FlipComplete(uint64_t timestamp_us) {
+  scheduler_.OnFlip(timestamp_us * 1000);
+  vsync_model_.AddSample(timestamp_us * 1000);
+
+  AutoLock lock(&flip_lock_, "flip");
+  if (lock.Lock())
+    return;
+
+  // The composition itself is freed on the frame worker, releasing its
+  // buffers here would race with the importer.
+  if (retiring_composition_)
+    retiring_composition_->SignalCompositionDone();
+  flip_pending_ = false;
+  pthread_cond_signal(&flip_cond_);
+}
+
+// The kernel rejects a non-blocking commit while the previous one is still
+// pending, so this is where the frame worker paces itself to the display.
+int DrmDisplayCompositor::WaitForPendingFlip() {
+  ATRACE_CALL();
+  std::unique_ptr<DrmDisplayComposition> retired;
+
+  AutoLock lock(&flip_lock_, "flip");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  int64_t nanos = deadline.tv_nsec + DRM_DISPLAY_COMPOSITOR_FLIP_TIMEOUT_NS;
+  deadline.tv_sec += nanos / (1000 * 1000 * 1000);
+  deadline.tv_nsec = nanos % (1000 * 1000 * 1000);
+  while (flip_pending_ && !ret)
+    ret = pthread_cond_timedwait(&flip_cond_, &flip_lock_, &deadline);
+
+  if (ret) {
+    ALOGE("Timed out waiting for page flip on display %d", display_);
+    flip_pending_ = false;
+    ret = -ETIMEDOUT;
+  }
+  retired = std::move(retiring_composition_);
+  lock.Unlock();
+
+  // Signals the release fences if the flip event never arrived
+  retired.reset();
+  return ret;
+}
+
 /* rotation property bits copied from kernel*/
 #define DRM_ROTATE_MASK 0x0f
 #define DRM_ROTATE_0 0
@@ -629,25 +1385,29 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     return -ENODEV;
   }
 
-  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
-  if (!pset) {
-    ALOGE("Failed to allocate property set");
-    return -ENOMEM;
-  }
+  // Test commits are made on the compositor thread and real ones on the frame
+  // worker, so each has a request of its own.
+  DrmAtomicRequest &request = test_only ? test_request_ : commit_request_;
+  request.Reset();
+  drmModeAtomicReqPtr pset = request.get();
 
   if (mode_.needs_modeset) {
-    ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->mode_property().id(),
-                                   mode_.blob_id) < 0 ||
-          drmModeAtomicAddProperty(pset, connector->id(),
-                                   connector->crtc_id_property().id(),
-                                   crtc->id()) < 0;
+    ret = request.AddProperty(crtc->id(), crtc->mode_property().id(),
+                              mode_.blob_id) < 0 ||
+          request.AddProperty(connector->id(),
+                              connector->crtc_id_property().id(),
+                              crtc->id()) < 0;
     if (ret) {
       ALOGE("Failed to add blob %d to pset", mode_.blob_id);
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
 
+  // Steady state frames are committed without blocking, the frame worker then
+  // waits for the flip event before its next commit. Modesets stay blocking
+  // since the mode and DPMS bookkeeping below depends on them having landed.
+  bool nonblocking = !test_only && !mode_.needs_modeset && nonblocking_commit_;
+
   for (DrmCompositionPlane &comp_plane : comp_planes) {
     DrmPlane *plane = comp_plane.plane;
     DrmCrtc *crtc = comp_plane.crtc;
@@ -657,6 +1417,7 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     DrmHwcRect<float> source_crop;
     uint64_t rotation = 0;
     uint64_t alpha = 0xFF;
+    int in_fence = -1;
     switch (comp_plane.source_layer) {
       case DrmCompositionPlane::kSourceNone:
         break;
@@ -673,16 +1434,22 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
           break;
         }
         DrmHwcLayer &layer = layers[comp_plane.source_layer];
-        if (!test_only && layer.acquire_fence.get() >= 0) {
+        if (!test_only && layer.acquire_fence.get() >= 0 &&
+            plane->in_fence_fd_property().id()) {
+          // Let the kernel wait, for all planes in parallel and without
+          // holding up the commit.
+          in_fence = layer.acquire_fence.get();
+        } else if (!test_only && layer.acquire_fence.get() >= 0) {
           int acquire_fence = layer.acquire_fence.get();
           int total_fence_timeout = 0;
           for (int i = 0; i < kAcquireWaitTries; ++i) {
             int fence_timeout = kAcquireWaitTimeoutMs * (1 << i);
             total_fence_timeout += fence_timeout;
             ret = sync_wait(acquire_fence, fence_timeout);
-            if (ret)
-              ALOGW("Acquire fence %d wait %d failed (%d). Total time %d",
-                    acquire_fence, i, ret, total_fence_timeout);
+            if (!ret)
+              break;
+            ALOGW("Acquire fence %d wait %d failed (%d). Total time %d",
+                  acquire_fence, i, ret, total_fence_timeout);
           }
           if (ret) {
             ALOGE("Failed to wait for acquire %d/%d", acquire_fence, ret);
@@ -716,10 +1483,9 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
 
     // Disable the plane if there's no framebuffer
     if (fb_id < 0) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->crtc_property().id(), 0) < 0 ||
-            drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->fb_property().id(), 0) < 0;
+      ret = request.AddProperty(plane->id(), plane->crtc_property().id(),
+                                0) < 0 ||
+            request.AddProperty(plane->id(), plane->fb_property().id(), 0) < 0;
       if (ret) {
         ALOGE("Failed to add plane %d disable to pset", plane->id());
         break;
@@ -741,33 +1507,28 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       break;
     }
 
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), crtc->id()) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->fb_property().id(), fb_id) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_x_property().id(),
-                                    display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_y_property().id(),
-                                    display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->crtc_w_property().id(),
-               display_frame.right - display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->crtc_h_property().id(),
-               display_frame.bottom - display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_x_property().id(),
-                                    (int)(source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_y_property().id(),
-                                    (int)(source_crop.top) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->src_w_property().id(),
+    ret = request.AddProperty(plane->id(), plane->crtc_property().id(),
+                              crtc->id()) < 0;
+    // Always sent, the new framebuffer is what makes the plane flip
+    ret |= request.ForceProperty(plane->id(), plane->fb_property().id(),
+                                 fb_id, true) < 0;
+    ret |= request.AddProperty(plane->id(), plane->crtc_x_property().id(),
+                               display_frame.left) < 0;
+    ret |= request.AddProperty(plane->id(), plane->crtc_y_property().id(),
+                               display_frame.top) < 0;
+    ret |= request.AddProperty(plane->id(), plane->crtc_w_property().id(),
+                               display_frame.right - display_frame.left) < 0;
+    ret |= request.AddProperty(plane->id(), plane->crtc_h_property().id(),
+                               display_frame.bottom - display_frame.top) < 0;
+    ret |= request.AddProperty(plane->id(), plane->src_x_property().id(),
+                               (int)(source_crop.left) << 16) < 0;
+    ret |= request.AddProperty(plane->id(), plane->src_y_property().id(),
+                               (int)(source_crop.top) << 16) < 0;
+    ret |= request.AddProperty(
+               plane->id(), plane->src_w_property().id(),
                (int)(source_crop.right - source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->src_h_property().id(),
+    ret |= request.AddProperty(
+               plane->id(), plane->src_h_property().id(),
                (int)(source_crop.bottom - source_crop.top) << 16) < 0;
     if (ret) {
       ALOGE("Failed to add plane %d to set", plane->id());
@@ -775,9 +1536,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->rotation_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->rotation_property().id(),
-                                     rotation) < 0;
+      ret = request.AddProperty(plane->id(), plane->rotation_property().id(),
+                                rotation) < 0;
       if (ret) {
         ALOGE("Failed to add rotation property %d to plane %d",
               plane->rotation_property().id(), plane->id());
@@ -786,35 +1546,95 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->alpha_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->alpha_property().id(),
-                                     alpha) < 0;
+      ret = request.AddProperty(plane->id(), plane->alpha_property().id(),
+                                alpha) < 0;
       if (ret) {
         ALOGE("Failed to add alpha property %d to plane %d",
               plane->alpha_property().id(), plane->id());
         break;
       }
     }
+
+    if (in_fence >= 0) {
+      ret = request.ForceProperty(plane->id(),
+                                  plane->in_fence_fd_property().id(),
+                                  in_fence, false) < 0;
+      if (ret) {
+        ALOGE("Failed to add in fence property %d to plane %d",
+              plane->in_fence_fd_property().id(), plane->id());
+        break;
+      }
+    }
   }
 
 out:
+  // With nothing changed there's no CRTC in the commit for a flip event to
+  // come from.
+  if (request.empty())
+    nonblocking = false;
+
+  // Whatever happens to this frame, the other displays in a combined commit
+  // mustn't be kept waiting for it.
+  if (commit_group_ && !test_only && (ret || !nonblocking))
+    commit_group_->Withdraw(display_comp->frame_no());
+
   if (!ret) {
-    uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+    uint32_t flags = 0;
+    if (mode_.needs_modeset)
+      flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
     if (test_only)
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
 
-    ret = drmModeAtomicCommit(drm_->fd(), pset, flags, drm_);
+    int64_t commit_start_ns = FrameScheduler::Now();
+    if (nonblocking) {
+      pthread_mutex_lock(&flip_lock_);
+      flip_pending_ = true;
+      pthread_mutex_unlock(&flip_lock_);
+
+      ret = -EAGAIN;
+      if (commit_group_)
+        ret = commit_group_->Commit(display_comp->frame_no(), this, pset);
+      if (ret == -EAGAIN) {
+        FlipCompleteHandler *handler = new FlipCompleteHandler(this);
+        ret = drmModeAtomicCommit(
+            drm_->fd(), pset,
+            flags | DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+            handler);
+        if (ret)
+          delete handler;
+      }
+      if (ret) {
+        // e.g. the crtc is off and can't deliver an event, try a plain commit
+        ALOGW("Non-blocking commit failed ret=%d, retrying blocking\n", ret);
+        pthread_mutex_lock(&flip_lock_);
+        flip_pending_ = false;
+        pthread_mutex_unlock(&flip_lock_);
+        ret = drmModeAtomicCommit(drm_->fd(), pset, flags, drm_);
+        nonblocking = false;
+      }
+    } else {
+      ret = drmModeAtomicCommit(drm_->fd(), pset, flags, drm_);
+    }
+    if (!ret && !test_only) {
+      request.Committed();
+      int64_t now = FrameScheduler::Now();
+      if (nonblocking) {
+        scheduler_.RecordStage(FrameScheduler::kStageCommit,
+                               now - commit_start_ns);
+        scheduler_.OnCommit(now);
+      } else {
+        // A blocking commit returns once it's on screen
+        scheduler_.OnFlip(now);
+      }
+    }
     if (ret) {
       if (test_only)
         ALOGI("Commit test pset failed ret=%d\n", ret);
       else
         ALOGE("Failed to commit pset ret=%d\n", ret);
-      drmModeAtomicFree(pset);
       return ret;
     }
   }
-  if (pset)
-    drmModeAtomicFree(pset);
 
   if (!test_only && mode_.needs_modeset) {
     ret = drm_->DestroyPropertyBlob(mode_.old_blob_id);
@@ -840,6 +1660,28 @@ out:
   return ret;
 }
 
+// Same as a test commit of |display_comp|, but configurations that were tested
+// recently are answered from the cache. Test commits that come with a modeset
+// are always sent, the cache only holds answers for the current mode.
+int DrmDisplayCompositor::TestFrame(DrmDisplayComposition *display_comp) {
+  if (!test_cache_enabled_ || mode_.needs_modeset)
+    return CommitFrame(display_comp, true);
+
+  DrmTestCache::Signature signature;
+  DrmTestCache::GetSignature(display_comp, &signature);
+
+  int ret;
+  if (test_cache_.Lookup(signature, &ret))
+    return ret;
+
+  ret = CommitFrame(display_comp, true);
+  // A test that left properties out depends on what was committed before it,
+  // not just on the layout
+  if (!test_request_.is_delta())
+    test_cache_.Insert(signature, ret);
+  return ret;
+}
+
 int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
   DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
   if (!conn) {
@@ -874,12 +1716,80 @@ std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
   return std::make_tuple(ret, id);
 }
 
+static bool IsSameLayerState(const DrmHwcLayer &a, const DrmHwcLayer &b) {
+  return a.buffer && b.buffer && a.buffer->fb_id == b.buffer->fb_id &&
+         a.display_frame == b.display_frame &&
+         a.source_crop == b.source_crop && a.transform == b.transform &&
+         a.blending == b.blending && a.alpha == b.alpha;
+}
+
+// SurfaceFlinger keeps resubmitting the same frame on screens that are mostly
+// idle. Buffers map to the same framebuffer each time they're imported, so
+// such a frame programs every plane exactly as the frame on screen does and
+// committing it would only cost an ioctl and a vblank wait.
+bool DrmDisplayCompositor::IsRedundantFrame(
+    DrmDisplayComposition *display_comp) const {
+  // The squash worker may be moving the active composition's layers
+  AutoLock lock(&lock_, "compositor");
+  if (lock.Lock())
+    return false;
+
+  DrmDisplayComposition *active = active_composition_.get();
+  if (!active || !active_composition_shown_ || mode_.needs_modeset ||
+      active->type() != DRM_COMPOSITION_TYPE_FRAME ||
+      display_comp->type() != DRM_COMPOSITION_TYPE_FRAME)
+    return false;
+
+  const std::vector<DrmCompositionPlane> &planes =
+      display_comp->composition_planes();
+  const std::vector<DrmCompositionPlane> &active_planes =
+      active->composition_planes();
+  if (planes.size() != active_planes.size())
+    return false;
+
+  for (size_t i = 0; i < planes.size(); i++) {
+    const DrmCompositionPlane &plane = planes[i];
+    const DrmCompositionPlane &active_plane = active_planes[i];
+    if (plane.plane != active_plane.plane || plane.crtc != active_plane.crtc)
+      return false;
+
+    bool has_layer = plane.source_layer <= DrmCompositionPlane::kSourceLayerMax;
+    bool active_has_layer =
+        active_plane.source_layer <= DrmCompositionPlane::kSourceLayerMax;
+    if (has_layer != active_has_layer)
+      return false;
+    if (!has_layer)
+      continue;
+
+    const DrmHwcLayer &layer = display_comp->layers()[plane.source_layer];
+    // The content may have changed under the same buffer
+    if (layer.acquire_fence.get() >= 0)
+      return false;
+    if (!IsSameLayerState(layer, active->layers()[active_plane.source_layer]))
+      return false;
+  }
+  return true;
+}
+
 void DrmDisplayCompositor::ApplyFrame(
     std::unique_ptr<DrmDisplayComposition> composition, int status) {
   int ret = status;
 
-  if (!ret)
+  // A pipelined frame's GL work may still be running
+  composition->FinishRender();
+
+  // Also frees the composition retired by the previous flip
+  WaitForPendingFlip();
+
+  bool skip_commit = !ret && IsRedundantFrame(composition.get());
+  if (skip_commit)
+    ++num_skipped_commits_;
+
+  if (!ret && !skip_commit)
     ret = CommitFrame(composition.get(), false);
+  else if (commit_group_)
+    commit_group_->Withdraw(composition->frame_no());
+  active_composition_shown_ = !ret;
 
   if (ret) {
     ALOGE("Composite failed for display %d", display_);
@@ -891,9 +1801,6 @@ void DrmDisplayCompositor::ApplyFrame(
   }
   ++dump_frames_composited_;
 
-  if (active_composition_)
-    active_composition_->SignalCompositionDone();
-
   ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire lock for active_composition swap");
@@ -904,55 +1811,79 @@ void DrmDisplayCompositor::ApplyFrame(
     ret = pthread_mutex_unlock(&lock_);
   if (ret)
     ALOGE("Failed to release lock for active_composition swap");
+
+  // If the commit is still in flight the previous composition stays on screen
+  // until the flip event arrives, otherwise it can be released right away.
+  pthread_mutex_lock(&flip_lock_);
+  if (flip_pending_)
+    retiring_composition_ = std::move(composition);
+  pthread_mutex_unlock(&flip_lock_);
+  if (composition)
+    composition->SignalCompositionDone();
+}
+
+// Holds the next frame back until just enough time is left to prepare and
+// commit it for the earliest vblank it can still make. Anything SurfaceFlinger
+// queues meanwhile replaces it, see DequeueComposition().
+void DrmDisplayCompositor::WaitForFrameStart() {
+  if (PeekNextCompositionType() != DRM_COMPOSITION_TYPE_FRAME)
+    return;
+
+  int64_t start_ns = scheduler_.NextStartTime(FrameScheduler::Now());
+  struct timespec ts;
+  ts.tv_sec = start_ns / (1000 * 1000 * 1000);
+  ts.tv_nsec = start_ns % (1000 * 1000 * 1000);
+  ATRACE_NAME("WaitForFrameStart");
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
 }
 
 int DrmDisplayCompositor::Composite() {
   ATRACE_CALL();
 
   if (!pre_compositor_) {
-    pre_compositor_.reset(new GLWorkerCompositor());
-    int ret = pre_compositor_->Init();
-    if (ret) {
-      ALOGE("Failed to initialize OpenGL compositor %d", ret);
-      return ret;
-    }
-  }
-
-  int ret = pthread_mutex_lock(&lock_);
-  if (ret) {
-    ALOGE("Failed to acquire compositor lock %d", ret);
-    return ret;
-  }
-  if (composite_queue_.empty()) {
-    ret = pthread_mutex_unlock(&lock_);
+    int ret = CreatePreCompositor(false, &pre_compositor_);
     if (ret)
-      ALOGE("Failed to release compositor lock %d", ret);
-    return ret;
+      return ret;
   }
 
-  std::unique_ptr<DrmDisplayComposition> composition(
-      std::move(composite_queue_.front()));
+  if (late_latch_)
+    WaitForFrameStart();
 
-  composite_queue_.pop();
+  std::unique_ptr<DrmDisplayComposition> composition =
+      DequeueComposition(late_latch_);
+  if (!composition)
+    return 0;
+  squash_worker_.NewComposition(composition->frame_no());
 
-  ret = pthread_mutex_unlock(&lock_);
-  if (ret) {
-    ALOGE("Failed to release compositor lock %d", ret);
-    return ret;
-  }
+  int ret = 0;
+  int64_t prepare_start_ns = FrameScheduler::Now();
+  FrameStrategy strategy;
 
   switch (composition->type()) {
     case DRM_COMPOSITION_TYPE_FRAME:
-      ret = PrepareFrame(composition.get());
+      strategy = SelectFrameStrategy(composition.get());
+      while (strategy == kStrategyPresentPrevious) {
+        if (!SkipToNextFrame(&composition)) {
+          strategy = kStrategyMergeRegions;
+          break;
+        }
+        squash_worker_.NewComposition(composition->frame_no());
+        num_strategy_frames_[kStrategyPresentPrevious]++;
+        strategy = SelectFrameStrategy(composition.get());
+      }
+      num_strategy_frames_[strategy]++;
+
+      ret = PrepareFrame(composition.get(), strategy);
       if (ret) {
         ALOGE("Failed to prepare frame for display %d", display_);
+        DropFrame(std::move(composition));
         return ret;
       }
       if (composition->geometry_changed()) {
         // Send the composition to the kernel to ensure we can commit it. This
         // is just a test, it won't actually commit the frame. If rejected,
         // squash the frame into one layer and use the squashed composition
-        ret = CommitFrame(composition.get(), true);
+        ret = TestFrame(composition.get());
         if (ret)
           ALOGI("Commit test failed, squashing frame for display %d", display_);
         use_hw_overlays_ = !ret;
@@ -963,17 +1894,22 @@ int DrmDisplayCompositor::Composite() {
       // instead.
       if (!use_hw_overlays_) {
         std::unique_ptr<DrmDisplayComposition> squashed = CreateComposition();
-        ret = SquashFrame(composition.get(), squashed.get());
+        ret = SquashFrame(composition.get(), squashed.get(),
+                          pre_compositor_.get());
         if (!ret) {
           composition = std::move(squashed);
         } else {
           ALOGE("Failed to squash frame for display %d", display_);
+          DropFrame(std::move(composition));
           return ret;
         }
       }
-      frame_worker_.QueueFrame(std::move(composition), ret);
+      scheduler_.RecordStage(FrameScheduler::kStagePrepare,
+                             FrameScheduler::Now() - prepare_start_ns);
+      frame_worker_.QueueFrame(&composition, ret, -1);
       break;
     case DRM_COMPOSITION_TYPE_DPMS:
+      test_cache_.Clear();
       ret = ApplyDpms(composition.get());
       if (ret)
         ALOGE("Failed to apply dpms for display %d", display_);
@@ -988,6 +1924,11 @@ int DrmDisplayCompositor::Composite() {
         return ret;
       }
       mode_.needs_modeset = true;
+      test_cache_.Clear();
+      QueueFramebufferPreallocation(mode_.mode);
+      scheduler_.SetRefreshRate(mode_.mode.v_refresh());
+      squash_worker_.SetRefreshRate(mode_.mode.v_refresh());
+      vsync_model_.Reset(mode_.mode.frame_period_ns());
       return 0;
     default:
       ALOGE("Unknown composition type %d", composition->type());
@@ -998,42 +1939,89 @@ int DrmDisplayCompositor::Composite() {
 }
 
 bool DrmDisplayCompositor::HaveQueuedComposites() const {
-  int ret = pthread_mutex_lock(&lock_);
-  if (ret) {
-    ALOGE("Failed to acquire compositor lock %d", ret);
+  if (!composite_queue_.empty())
+    return true;
+  if (!mailbox_)
     return false;
-  }
-
-  bool empty_ret = !composite_queue_.empty();
 
-  ret = pthread_mutex_unlock(&lock_);
-  if (ret) {
-    ALOGE("Failed to release compositor lock %d", ret);
+  AutoLock lock(&mailbox_lock_, "mailbox");
+  if (lock.Lock())
     return false;
-  }
+  return mailbox_frame_ != NULL;
+}
 
-  return empty_ret;
+// Moves the layers that PlanSquashFrame() took from |src| back, in the order
+// they were taken in.
+static void ReturnSquashedLayers(DrmDisplayComposition *src,
+                                 DrmDisplayComposition *dst) {
+  std::vector<DrmHwcLayer> &src_layers = src->layers();
+  std::vector<DrmHwcLayer> &dst_layers = dst->layers();
+  size_t dst_index = 0;
+  for (DrmCompositionPlane &comp_plane : src->composition_planes()) {
+    if (comp_plane.source_layer >= src_layers.size())
+      continue;
+    if (dst_index >= dst_layers.size())
+      break;
+    src_layers[comp_plane.source_layer] = std::move(dst_layers[dst_index++]);
+  }
 }
 
-int DrmDisplayCompositor::SquashAll() {
+// Runs on the squash worker once the display has been idle for a while, see
+// SquashWorker. The compositor lock is only held while the layers are moved
+// out of the active composition, not for the render, so a frame that comes
+// along meanwhile doesn't have to wait. Such a frame makes the squash stale
+// and it is thrown away.
+int DrmDisplayCompositor::SquashIdle(uint64_t generation, uint64_t frame_no) {
+  ATRACE_CALL();
+
+  if (!squash_pre_compositor_) {
+    int ret = CreatePreCompositor(true, &squash_pre_compositor_);
+    if (ret)
+      return ret;
+  }
+
+  std::unique_ptr<DrmDisplayComposition> comp = CreateComposition();
   AutoLock lock(&lock_, "compositor");
   int ret = lock.Lock();
   if (ret)
     return ret;
 
-  if (!active_composition_)
-    return 0;
-
-  std::unique_ptr<DrmDisplayComposition> comp = CreateComposition();
-  ret = SquashFrame(active_composition_.get(), comp.get());
+  // Squashing while frames are still on their way to the screen would put
+  // older content back up after them.
+  DrmDisplayComposition *src = active_composition_.get();
+  if (!src || src->frame_no() != frame_no)
+    return -ECANCELED;
 
-  // ApplyFrame needs the lock
+  ret = PlanSquashFrame(src, comp.get());
   lock.Unlock();
+  if (ret)
+    return ret;
 
-  if (!ret)
-    ApplyFrame(std::move(comp), 0);
+  ret = RenderSquashFrame(comp.get(), squash_pre_compositor_.get());
 
-  return ret;
+  // Compositions queue their frames after bumping the generation, so checking
+  // it under the worker's lock orders the squash before anything newer. The
+  // compositor worker takes that lock for every composition, so the squash
+  // must not block on the frame queue while holding it: if the queue is full
+  // something newer is on its way anyway and the squash is dropped.
+  bool queued = false;
+  if (!ret && !squash_worker_.Lock()) {
+    if (squash_worker_.IsCurrentLocked(generation))
+      queued = !frame_worker_.QueueFrame(&comp, 0, 0);
+    squash_worker_.Unlock();
+  }
+  if (queued)
+    return 0;
+
+  // Unless it has been replaced already, the active composition gets its
+  // layers back.
+  if (!lock.Lock()) {
+    if (active_composition_.get() == src && src->frame_no() == frame_no)
+      ReturnSquashedLayers(src, comp.get());
+    lock.Unlock();
+  }
+
+  return ret ? ret : -ECANCELED;
 }
 
 // Returns:
@@ -1041,7 +2029,23 @@ int DrmDisplayCompositor::SquashAll() {
 //   - -EALREADY if the src is already squashed
 //   - Appropriate error if the squash fails
 int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
-                                      DrmDisplayComposition *dst) {
+                                      DrmDisplayComposition *dst,
+                                      PreCompositor *pre_compositor) {
+  int ret = PlanSquashFrame(src, dst);
+  if (ret)
+    return ret;
+
+  ret = RenderSquashFrame(dst, pre_compositor);
+  if (ret)
+    ReturnSquashedLayers(src, dst);
+  return ret;
+}
+
+// Moves the layers of |src| into |dst| and plans |dst| to show them all on the
+// primary plane through one precomposition. Takes the same return values as
+// SquashFrame().
+int DrmDisplayCompositor::PlanSquashFrame(DrmDisplayComposition *src,
+                                          DrmDisplayComposition *dst) {
   if (src->type() != DRM_COMPOSITION_TYPE_FRAME)
     return -ENOTSUP;
 
@@ -1056,8 +2060,6 @@ int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
   if (src_planes_with_layer <= 1)
     return -EALREADY;
 
-  int pre_comp_layer_index;
-
   int ret = dst->Init(drm_, src->crtc(), src->importer(), src->frame_no());
   if (ret) {
     ALOGE("Failed to init squash all composition %d", ret);
@@ -1119,22 +2121,11 @@ int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
       dst->Plan(NULL /* SquashState */, &primary_planes, &fake_overlay_planes);
   if (ret) {
     ALOGE("Failed to plan for squash all composition %d", ret);
-    goto move_layers_back;
-  }
-
-  ret = ApplyPreComposite(dst);
-  if (ret) {
-    ALOGE("Failed to pre-composite for squash all composition %d", ret);
-    goto move_layers_back;
+    // The layers already belong to dst
+    ReturnSquashedLayers(src, dst);
+    return ret;
   }
 
-  pre_comp_layer_index = dst->layers().size() - 1;
-  framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
-
-  for (DrmCompositionPlane &plane : dst->composition_planes())
-    if (plane.source_layer == DrmCompositionPlane::kSourcePreComp)
-      plane.source_layer = pre_comp_layer_index;
-
   return 0;
 
 // TODO(zachr): think of a better way to transfer ownership back to the active
@@ -1150,6 +2141,25 @@ move_layers_back:
   return ret;
 }
 
+// Renders the precomposition planned by PlanSquashFrame(). The layers stay in
+// |dst| even if this fails.
+int DrmDisplayCompositor::RenderSquashFrame(DrmDisplayComposition *dst,
+                                            PreCompositor *pre_compositor) {
+  int ret = ApplyPreComposite(dst, pre_compositor);
+  if (ret) {
+    ALOGE("Failed to pre-composite for squash all composition %d", ret);
+    return ret;
+  }
+
+  int pre_comp_layer_index = dst->layers().size() - 1;
+
+  for (DrmCompositionPlane &plane : dst->composition_planes())
+    if (plane.source_layer == DrmCompositionPlane::kSourcePreComp)
+      plane.source_layer = pre_comp_layer_index;
+
+  return 0;
+}
+
 void DrmDisplayCompositor::Dump(std::ostringstream *out) const {
   int ret = pthread_mutex_lock(&lock_);
   if (ret)
@@ -1171,15 +2181,43 @@ void DrmDisplayCompositor::Dump(std::ostringstream *out) const {
 
   *out << "--DrmDisplayCompositor[" << display_
        << "]: num_frames=" << num_frames << " num_ms=" << num_ms
-       << " fps=" << fps << "\n";
+       << " fps=" << fps << " pre_compositor="
+       << (pre_compositor_ ? pre_compositor_->name() : "none") << "\n";
 
   dump_last_timestamp_ns_ = cur_ts;
 
   if (active_composition_)
     active_composition_->Dump(out);
 
+  *out << "  Composite queue: ";
+  composite_queue_.Dump(out);
+  *out << " superseded_frames=" << num_superseded_frames_
+       << " skipped_commits=" << num_skipped_commits_ << "\n";
+  if (mailbox_ && !pthread_mutex_lock(&mailbox_lock_)) {
+    *out << "  Mailbox: pending=" << (mailbox_frame_ ? 1 : 0) << "\n";
+    pthread_mutex_unlock(&mailbox_lock_);
+  }
+  *out << "  Frame scheduler: late_latch=" << late_latch_
+       << " pipeline_depth=" << pipeline_depth_ << " ";
+  scheduler_.Dump(out);
+  *out << "\n";
+  *out << "  VSync model: ";
+  vsync_model_.Dump(out);
+  *out << "\n";
+  *out << "  Frame strategies: deadline_strategy=" << deadline_strategy_
+       << " full=" << num_strategy_frames_[kStrategyFull]
+       << " defer_squash=" << num_strategy_frames_[kStrategyDeferSquash]
+       << " merge_regions=" << num_strategy_frames_[kStrategyMergeRegions]
+       << " present_previous=" << num_strategy_frames_[kStrategyPresentPrevious]
+       << "\n";
+
+  test_cache_.Dump(out);
   squash_state_.Dump(out);
 
+  *out << "  Framebuffer pools:\n";
+  for (const DrmFramebufferPool &pool : framebuffer_pools_)
+    pool.Dump(out);
+
   pthread_mutex_unlock(&lock_);
 }
 }
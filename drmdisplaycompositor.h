@@ -18,12 +18,21 @@
 #define ANDROID_DRM_DISPLAY_COMPOSITOR_H_
 
 #include "drmhwcomposer.h"
+#include "boundedqueue.h"
+#include "drmatomicrequest.h"
 #include "drmcomposition.h"
 #include "drmcompositorworker.h"
 #include "drmframebuffer.h"
+#include "drmframebufferpool.h"
+#include "drmtestcache.h"
+#include "framescheduler.h"
+#include "glcompositorservice.h"
+#include "precompositor.h"
 #include "separate_rects.h"
+#include "vsyncmodel.h"
 
 #include <pthread.h>
+#include <atomic>
 #include <memory>
 #include <queue>
 #include <sstream>
@@ -31,14 +40,26 @@
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
+#include <ui/PixelFormat.h>
 
 // One for the front, one for the back, and one for cases where we need to
 // squash a frame that the hw can't display with hw overlays.
 #define DRM_DISPLAY_BUFFERS 3
 
+// Precomposition and squash targets are pooled per pixel format, see
+// DrmDisplayCompositor::GetFramebufferFormat().
+#define DRM_DISPLAY_BUFFER_FORMATS 3
+
+// Enough for DRM_DISPLAY_BUFFERS precomposition buffers plus the squash
+// buffer on screen and the one being rendered.
+#define DRM_DISPLAY_POOL_BUFFERS (DRM_DISPLAY_BUFFERS + 2)
+
+// Full screen RGBA buffers allocated up front when the mode changes.
+#define DRM_DISPLAY_PREALLOCATED_BUFFERS 2
+
 namespace android {
 
-class GLWorkerCompositor;
+class DrmCommitGroup;
 
 class SquashState {
  public:
@@ -91,13 +112,34 @@ class DrmDisplayCompositor {
   std::unique_ptr<DrmDisplayComposition> CreateComposition() const;
   int QueueComposition(std::unique_ptr<DrmDisplayComposition> composition);
   int Composite();
-  int SquashAll();
   void Dump(std::ostringstream *out) const;
 
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
   bool HaveQueuedComposites() const;
 
+  // Frames are committed together with the other displays' through |group|,
+  // see DrmCommitGroup. Must be set before any frames are queued.
+  void set_commit_group(DrmCommitGroup *group) {
+    commit_group_ = group;
+  }
+
+  // Precomposition goes through the shared GL thread rather than a context
+  // of this display's own. Must be set before any frames are queued.
+  void set_gl_service(GLCompositorService *service) {
+    gl_service_ = service;
+  }
+
+  // Called on the event listener thread once a non-blocking commit has been
+  // latched by the hardware.
+  void FlipComplete(uint64_t timestamp_us);
+
+  // Fed with the page flip timestamps here and the vblank timestamps by the
+  // display's VSyncWorker.
+  VSyncModel *vsync_model() {
+    return &vsync_model_;
+  }
+
   SquashState *squash_state() {
     return &squash_state_;
   }
@@ -113,16 +155,71 @@ class DrmDisplayCompositor {
     FrameWorker(DrmDisplayCompositor *compositor);
     ~FrameWorker() override;
 
+    int Init(size_t max_depth);
+    // Waits up to |timeout_ns| for room, forever if negative. Returns
+    // -ETIMEDOUT if there was none, |composition| is left to the caller then.
+    int QueueFrame(std::unique_ptr<DrmDisplayComposition> *composition,
+                   int status, int64_t timeout_ns);
+
+   protected:
+    void Routine() override;
+
+   private:
+    DrmDisplayCompositor *compositor_;
+    BoundedQueue<FrameState> frame_queue_;
+  };
+
+  // Squashes everything on screen into a single plane once the display has
+  // been idle for a while, see SquashIdle(). Runs at low priority and gives
+  // up on a squash as soon as a newer composition comes along.
+  class SquashWorker : public Worker {
+   public:
+    SquashWorker(DrmDisplayCompositor *compositor);
+    ~SquashWorker() override;
+
     int Init();
-    void QueueFrame(std::unique_ptr<DrmDisplayComposition> composition,
-                    int status);
+    void SetRefreshRate(float refresh_hz);
+    // Called by the compositor worker for every composition it takes on,
+    // before it queues anything for the frame worker.
+    void NewComposition(uint64_t frame_no);
+
+    // Must be called with the lock acquired. Returns true if no composition
+    // came along since |generation|.
+    bool IsCurrentLocked(uint64_t generation) const {
+      return generation == generation_;
+    }
 
    protected:
     void Routine() override;
 
    private:
+    // Bounds for how long the display has to be idle before it's squashed.
+    // The wait is a few times the recent interval between updates, so that
+    // content updating at a steady low rate isn't squashed between updates.
+    static const int kMinIdleFrames = 10;
+    static const int kIdleIntervals = 4;
+    static const int64_t kMaxIdleNs = 500 * 1000 * 1000LL;
+
+    int64_t IdleTimeoutLocked() const;
+
     DrmDisplayCompositor *compositor_;
-    std::queue<FrameState> frame_queue_;
+    uint64_t generation_;
+    uint64_t squashed_generation_;
+    uint64_t frame_no_;
+    int64_t last_composition_ns_;
+    int64_t interval_ns_;
+    int64_t period_ns_;
+    bool waiting_;
+  };
+
+  // How much of a frame's GL work gets done, see SelectFrameStrategy(). Each
+  // strategy includes the degradations of the ones before it.
+  enum FrameStrategy {
+    kStrategyFull,
+    kStrategyDeferSquash,      // leave the squash render to a later frame
+    kStrategyMergeRegions,     // fewer, larger precomposition regions
+    kStrategyPresentPrevious,  // skip the frame in favour of a newer one
+    kNumFrameStrategies,
   };
 
   struct ModeState {
@@ -139,13 +236,58 @@ class DrmDisplayCompositor {
   static const int kAcquireWaitTries = 5;
   static const int kAcquireWaitTimeoutMs = 100;
 
-  int PrepareFramebuffer(DrmFramebuffer &fb,
-                         DrmDisplayComposition *display_comp);
+  // Precomposition and squash framebuffers are rounded up to a multiple of
+  // this many pixels in each dimension so that small changes in the area they
+  // cover don't force a reallocation.
+  static const int kFramebufferSizeAlign = 64;
+
+  // Without pipelining frames are normally committed as fast as they are
+  // prepared, this only bounds how far the compositor can get ahead of a
+  // stalled commit.
+  static const size_t kMaxFrameQueueDepth = 8;
+
+  // |idle| is for the squash worker, whose renders have no deadline
+  int CreatePreCompositor(bool idle,
+                          std::unique_ptr<PreCompositor> *compositor);
+  DrmHwcRect<int> GetFramebufferFrame(
+      DrmDisplayComposition *display_comp,
+      const std::vector<DrmCompositionRegion> &regions, size_t source);
+  PixelFormat GetFramebufferFormat(
+      const std::vector<DrmHwcLayer> &layers,
+      const std::vector<DrmCompositionRegion> &regions,
+      const DrmHwcRect<int> &frame) const;
+  DrmFramebufferPool &GetFramebufferPool(PixelFormat format);
+  void QueueFramebufferPreallocation(const DrmMode &mode);
+  int PrepareFramebuffer(DrmDisplayComposition *display_comp,
+                         PreCompositor *pre_compositor,
+                         const DrmHwcRect<int> &frame, PixelFormat format,
+                         DrmFramebuffer **fb);
+  bool SubmitRender(PreCompositor *pre_compositor,
+                    DrmDisplayComposition *display_comp);
   int ApplySquash(DrmDisplayComposition *display_comp);
-  int ApplyPreComposite(DrmDisplayComposition *display_comp);
-  int PrepareFrame(DrmDisplayComposition *display_comp);
+  int ApplyPreComposite(DrmDisplayComposition *display_comp,
+                        PreCompositor *pre_compositor);
+  int QueueMailboxFrame(std::unique_ptr<DrmDisplayComposition> composition);
+  std::unique_ptr<DrmDisplayComposition> TakeNextComposition();
+  std::unique_ptr<DrmDisplayComposition> TakeNextFrame();
+  DrmCompositionType PeekNextCompositionType();
+  bool SkipToNextFrame(std::unique_ptr<DrmDisplayComposition> *frame);
+  void DropFrame(std::unique_ptr<DrmDisplayComposition> frame);
+  std::unique_ptr<DrmDisplayComposition> DequeueComposition(bool newest_frame);
+  void WaitForFrameStart();
+  FrameStrategy SelectFrameStrategy(DrmDisplayComposition *display_comp);
+  int PrepareFrame(DrmDisplayComposition *display_comp,
+                   FrameStrategy strategy);
   int CommitFrame(DrmDisplayComposition *display_comp, bool test_only);
-  int SquashFrame(DrmDisplayComposition *src, DrmDisplayComposition *dst);
+  int TestFrame(DrmDisplayComposition *display_comp);
+  bool IsRedundantFrame(DrmDisplayComposition *display_comp) const;
+  int WaitForPendingFlip();
+  int SquashFrame(DrmDisplayComposition *src, DrmDisplayComposition *dst,
+                  PreCompositor *pre_compositor);
+  int PlanSquashFrame(DrmDisplayComposition *src, DrmDisplayComposition *dst);
+  int RenderSquashFrame(DrmDisplayComposition *dst,
+                        PreCompositor *pre_compositor);
+  int SquashIdle(uint64_t generation, uint64_t frame_no);
   int ApplyDpms(DrmDisplayComposition *display_comp);
   int DisablePlanes(DrmDisplayComposition *display_comp);
 
@@ -159,9 +301,28 @@ class DrmDisplayCompositor {
 
   DrmCompositorWorker worker_;
   FrameWorker frame_worker_;
-
-  std::queue<std::unique_ptr<DrmDisplayComposition>> composite_queue_;
+  SquashWorker squash_worker_;
+
+  // How many frames may be between the start of their GL work and their
+  // commit at once. With more than one the compositor worker starts on the
+  // next frame without waiting for the GPU, and the frame worker waits for it
+  // before committing.
+  int pipeline_depth_;
+
+  BoundedQueue<std::unique_ptr<DrmDisplayComposition>> composite_queue_;
+
+  // In mailbox mode frames are parked here rather than in composite_queue_,
+  // and a newer frame replaces one that hasn't been picked up yet. Ordering
+  // with the compositions in composite_queue_ is kept by frame_no.
+  bool mailbox_;
+  std::unique_ptr<DrmDisplayComposition> mailbox_frame_;
+  std::atomic<uint64_t> num_superseded_frames_;
+  mutable pthread_mutex_t mailbox_lock_;
   std::unique_ptr<DrmDisplayComposition> active_composition_;
+  // Whether active_composition_ is what the hardware is actually showing,
+  // i.e. it was committed successfully.
+  bool active_composition_shown_;
+  uint64_t num_skipped_commits_;
 
   bool initialized_;
   bool active_;
@@ -169,13 +330,52 @@ class DrmDisplayCompositor {
 
   ModeState mode_;
 
-  int framebuffer_index_;
-  DrmFramebuffer framebuffers_[DRM_DISPLAY_BUFFERS];
-  std::unique_ptr<GLWorkerCompositor> pre_compositor_;
+  DrmFramebufferPool framebuffer_pools_[DRM_DISPLAY_BUFFER_FORMATS];
+  DrmFramebufferAllocator framebuffer_allocator_;
+  GLCompositorService *gl_service_;
+  std::unique_ptr<PreCompositor> pre_compositor_;
+  // The squash worker's renders are queued behind the frames', and without
+  // the shared GL thread it needs a context of its own.
+  std::unique_ptr<PreCompositor> squash_pre_compositor_;
 
   SquashState squash_state_;
-  int squash_framebuffer_index_;
-  DrmFramebuffer squash_framebuffers_[2];
+  // The last squash framebuffer is pinned in its pool, along with the area
+  // of the display it was rendered for, so that it can be scanned out again
+  // in later frames.
+  DrmFramebuffer *squash_framebuffer_;
+  DrmHwcRect<int> squash_frame_;
+  PixelFormat squash_format_;
+  // A squash render that was put off to meet a deadline, along with the
+  // number of layers of the frame it came from.
+  std::vector<DrmCompositionRegion> deferred_squash_regions_;
+  size_t deferred_squash_num_layers_;
+
+  // Late latching, see WaitForFrameStart()
+  bool late_latch_;
+  FrameScheduler scheduler_;
+  VSyncModel vsync_model_;
+
+  // Deadline aware frame preparation, see SelectFrameStrategy()
+  bool deadline_strategy_;
+  uint64_t num_strategy_frames_[kNumFrameStrategies];
+
+  // Answers for test commits of recently seen layouts, see TestFrame()
+  bool test_cache_enabled_;
+  DrmTestCache test_cache_;
+
+  // Non-blocking commits, see CommitFrame(). flip_pending_ is set while the
+  // kernel holds a commit that hasn't reached the screen yet. The composition
+  // it replaces is parked in retiring_composition_ and its release fences are
+  // signaled from FlipComplete().
+  bool nonblocking_commit_;
+  DrmCommitGroup *commit_group_;
+  // Only carry what changed since the last commit, see CommitFrame()
+  DrmAtomicRequest test_request_;
+  DrmAtomicRequest commit_request_;
+  bool flip_pending_;
+  std::unique_ptr<DrmDisplayComposition> retiring_composition_;
+  pthread_mutex_t flip_lock_;
+  pthread_cond_t flip_cond_;
 
   // mutable since we need to acquire in HaveQueuedComposites
   mutable pthread_mutex_t lock_;
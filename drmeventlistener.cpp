@@ -17,10 +17,16 @@
 #define LOG_TAG "hwc-drm-event-listener"
 
 #include "drmeventlistener.h"
+#include "autolock.h"
 #include "drmresources.h"
 
+#include <errno.h>
 #include <linux/netlink.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <xf86drm.h>
@@ -32,8 +38,51 @@ DrmEventListener::DrmEventListener(DrmResources *drm)
       drm_(drm) {
 }
 
+DrmEventListener::~DrmEventListener() {
+  if (!sources_initialized_)
+    return;
+  pthread_cond_destroy(&dispatch_cond_);
+  pthread_mutex_destroy(&sources_lock_);
+}
+
 int DrmEventListener::Init() {
-  uevent_fd_.Set(socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT));
+  int ret = pthread_mutex_init(&sources_lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize event listener lock %d", ret);
+    return ret;
+  }
+  ret = pthread_cond_init(&dispatch_cond_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize event listener condition %d", ret);
+    pthread_mutex_destroy(&sources_lock_);
+    return ret;
+  }
+  sources_initialized_ = true;
+
+  epoll_fd_.Set(epoll_create1(EPOLL_CLOEXEC));
+  if (epoll_fd_.get() < 0) {
+    ALOGE("Failed to create epoll instance %d", -errno);
+    return -errno;
+  }
+
+  wake_fd_.Set(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (wake_fd_.get() < 0) {
+    ALOGE("Failed to create wakeup eventfd %d", -errno);
+    return -errno;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u64 = kWakeSourceId;
+  ret = epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, wake_fd_.get(), &event);
+  if (ret) {
+    ALOGE("Failed to add wakeup eventfd %d", -errno);
+    return -errno;
+  }
+
+  uevent_fd_.Set(socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        NETLINK_KOBJECT_UEVENT));
   if (uevent_fd_.get() < 0) {
     ALOGE("Failed to open uevent socket %d", uevent_fd_.get());
     return uevent_fd_.get();
@@ -45,16 +94,23 @@ int DrmEventListener::Init() {
   addr.nl_pid = getpid();
   addr.nl_groups = 0xFFFFFFFF;
 
-  int ret = bind(uevent_fd_.get(), (struct sockaddr *)&addr, sizeof(addr));
+  ret = bind(uevent_fd_.get(), (struct sockaddr *)&addr, sizeof(addr));
   if (ret) {
     ALOGE("Failed to bind uevent socket %d", -errno);
     return -errno;
   }
 
-  FD_ZERO(&fds_);
-  FD_SET(drm_->fd(), &fds_);
-  FD_SET(uevent_fd_.get(), &fds_);
-  max_fd_ = std::max(drm_->fd(), uevent_fd_.get());
+  ret = AddFd(drm_->fd(), EPOLLIN,
+              [this](int, uint32_t, int64_t) { DrmHandler(); });
+  if (ret)
+    return ret;
+
+  ret = AddFd(uevent_fd_.get(), EPOLLIN,
+              [this](int, uint32_t, int64_t timestamp_ns) {
+                UEventHandler(timestamp_ns);
+              });
+  if (ret)
+    return ret;
 
   return InitWorker();
 }
@@ -64,6 +120,57 @@ void DrmEventListener::RegisterHotplugHandler(DrmEventHandler *handler) {
   hotplug_handler_ = handler;
 }
 
+int DrmEventListener::AddFd(int fd, uint32_t events, FdHandler handler) {
+  AutoLock lock(&sources_lock_, "event-listener");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  uint64_t id = next_source_id_++;
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.u64 = id;
+  ret = epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fd, &event);
+  if (ret) {
+    ALOGE("Failed to add fd %d to the event loop %d", fd, -errno);
+    return -errno;
+  }
+
+  sources_[id] = std::make_shared<Source>(Source{fd, std::move(handler)});
+  return 0;
+}
+
+int DrmEventListener::RemoveFd(int fd) {
+  AutoLock lock(&sources_lock_, "event-listener");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  auto it = sources_.begin();
+  while (it != sources_.end() && it->second->fd != fd)
+    ++it;
+  if (it == sources_.end())
+    return -ENOENT;
+
+  ret = epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, NULL);
+  if (ret)
+    ALOGE("Failed to remove fd %d from the event loop %d", fd, -errno);
+  sources_.erase(it);
+
+  while (dispatching_ && dispatching_->fd == fd &&
+         !pthread_equal(dispatch_thread_, pthread_self()))
+    pthread_cond_wait(&dispatch_cond_, &sources_lock_);
+  return 0;
+}
+
+void DrmEventListener::Interrupt() {
+  uint64_t value = 1;
+  if (wake_fd_.get() >= 0 && write(wake_fd_.get(), &value, sizeof(value)) < 0 &&
+      errno != EAGAIN)
+    ALOGE("Failed to wake the event loop %d", -errno);
+}
+
 void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
                                    unsigned int tv_sec, unsigned int tv_usec,
                                    void *user_data) {
@@ -72,29 +179,34 @@ void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
     return;
 
   handler->HandleEvent((uint64_t)tv_sec * 1000 * 1000 + tv_usec);
-  delete handler;
+  if (handler->HandledAllEvents())
+    delete handler;
+}
+
+void DrmEventListener::DrmHandler() {
+  drmEventContext event_context = {
+      .version = DRM_EVENT_CONTEXT_VERSION,
+      .vblank_handler = DrmEventListener::FlipHandler,
+      .page_flip_handler = DrmEventListener::FlipHandler};
+  drmHandleEvent(drm_->fd(), &event_context);
 }
 
-void DrmEventListener::UEventHandler() {
+void DrmEventListener::UEventHandler(int64_t timestamp_ns) {
   char buffer[1024];
   int ret;
 
-  struct timespec ts;
-  uint64_t timestamp = 0;
-  ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-  if (!ret)
-    timestamp = ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
-  else
-    ALOGE("Failed to get monotonic clock on hotplug %d", ret);
-
   while (true) {
-    ret = read(uevent_fd_.get(), &buffer, sizeof(buffer));
+    ret = read(uevent_fd_.get(), &buffer, sizeof(buffer) - 1);
     if (ret == 0) {
       return;
     } else if (ret < 0) {
-      ALOGE("Got error reading uevent %d", ret);
-      return;
+      if (errno != EAGAIN && errno != EINTR)
+        ALOGE("Got error reading uevent %d", -errno);
+      if (errno != EINTR)
+        return;
+      continue;
     }
+    buffer[ret] = '\0';
 
     if (!hotplug_handler_)
       continue;
@@ -102,34 +214,64 @@ void DrmEventListener::UEventHandler() {
     bool drm_event = false, hotplug_event = false;
     for (int i = 0; i < ret;) {
       char *event = buffer + i;
-      if (strcmp(event, "DEVTYPE=drm_minor"))
+      if (!strcmp(event, "DEVTYPE=drm_minor"))
         drm_event = true;
-      else if (strcmp(event, "HOTPLUG=1"))
+      else if (!strcmp(event, "HOTPLUG=1"))
         hotplug_event = true;
 
       i += strlen(event) + 1;
     }
 
     if (drm_event && hotplug_event)
-      hotplug_handler_->HandleEvent(timestamp);
+      hotplug_handler_->HandleEvent(timestamp_ns / 1000);
   }
 }
 
+void DrmEventListener::Dispatch(uint64_t id, uint32_t events,
+                                int64_t timestamp_ns) {
+  AutoLock lock(&sources_lock_, "event-listener");
+  if (lock.Lock())
+    return;
+
+  // Removed while its event was waiting
+  auto it = sources_.find(id);
+  if (it == sources_.end())
+    return;
+  std::shared_ptr<Source> source = it->second;
+  dispatching_ = source;
+  dispatch_thread_ = pthread_self();
+  lock.Unlock();
+
+  source->handler(source->fd, events, timestamp_ns);
+
+  if (lock.Lock())
+    return;
+  dispatching_.reset();
+  pthread_cond_broadcast(&dispatch_cond_);
+}
+
 void DrmEventListener::Routine() {
-  int ret;
-  do {
-    ret = select(max_fd_ + 1, &fds_, NULL, NULL, NULL);
-  } while (ret == -1 && errno == EINTR);
-
-  if (FD_ISSET(drm_->fd(), &fds_)) {
-    drmEventContext event_context = {
-        .version = DRM_EVENT_CONTEXT_VERSION,
-        .vblank_handler = NULL,
-        .page_flip_handler = DrmEventListener::FlipHandler};
-    drmHandleEvent(drm_->fd(), &event_context);
+  struct epoll_event events[kMaxEvents];
+  int num_events = epoll_wait(epoll_fd_.get(), events, kMaxEvents, -1);
+  if (num_events < 0) {
+    if (errno != EINTR)
+      ALOGE("Failed to wait for events %d", -errno);
+    return;
   }
 
-  if (FD_ISSET(uevent_fd_.get(), &fds_))
-    UEventHandler();
+  struct timespec ts;
+  int64_t timestamp_ns = 0;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    timestamp_ns = ts.tv_sec * 1000LL * 1000 * 1000 + ts.tv_nsec;
+
+  for (int i = 0; i < num_events; i++) {
+    if (events[i].data.u64 == kWakeSourceId) {
+      uint64_t value;
+      if (read(wake_fd_.get(), &value, sizeof(value)) < 0 && errno != EAGAIN)
+        ALOGE("Failed to read wakeup eventfd %d", -errno);
+      continue;
+    }
+    Dispatch(events[i].data.u64, events[i].events, timestamp_ns);
+  }
 }
 }
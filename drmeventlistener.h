@@ -20,6 +20,12 @@
 #include "autofd.h"
 #include "worker.h"
 
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+
 namespace android {
 
 class DrmResources;
@@ -32,33 +38,82 @@ class DrmEventHandler {
   }
 
   virtual void HandleEvent(uint64_t timestamp_us) = 0;
+
+  // Page flip handlers are deleted once this returns true after an event. A
+  // commit that spans several CRTCs gets an event for each of them.
+  virtual bool HandledAllEvents() const {
+    return true;
+  }
 };
 
+// Runs the event loop of the DRM device. Besides page flips and hotplug
+// uevents, any fd can be added as a source, e.g. a timerfd or an eventfd that
+// a queue writes to, and its handler is then run on the listener thread
+// whenever it becomes ready.
 class DrmEventListener : public Worker {
  public:
+  // |timestamp_ns| is the CLOCK_MONOTONIC time the loop woke up at, shared
+  // by all the sources that were ready at once. |events| are the EPOLL*
+  // flags that were raised.
+  typedef std::function<void(int fd, uint32_t events, int64_t timestamp_ns)>
+      FdHandler;
+
   DrmEventListener(DrmResources *drm);
-  virtual ~DrmEventListener() {
-  }
+  virtual ~DrmEventListener();
 
   int Init();
 
   void RegisterHotplugHandler(DrmEventHandler *handler);
 
+  // |fd| stays owned by the caller and has to stay open until RemoveFd(). Only
+  // one handler can be added for each fd.
+  int AddFd(int fd, uint32_t events, FdHandler handler);
+  // Once this returns the handler is neither running nor called again, unless
+  // this is called from the handler itself.
+  int RemoveFd(int fd);
+
+  // Page flip and vblank events both carry a DrmEventHandler as user data
   static void FlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
                           unsigned int tv_usec, void *user_data);
 
  protected:
   virtual void Routine();
+  void Interrupt() override;
 
  private:
-  void UEventHandler();
+  struct Source {
+    int fd;
+    FdHandler handler;
+  };
+
+  // Sources ready at the same time are handled in one go, the rest wait for
+  // the next round.
+  static const int kMaxEvents = 16;
+  // epoll user data of the wakeup eventfd, sources are numbered from 1
+  static const uint64_t kWakeSourceId = 0;
+
+  void DrmHandler();
+  void UEventHandler(int64_t timestamp_ns);
+  void Dispatch(uint64_t id, uint32_t events, int64_t timestamp_ns);
 
-  fd_set fds_;
+  UniqueFd epoll_fd_;
+  UniqueFd wake_fd_;
   UniqueFd uevent_fd_;
-  int max_fd_ = -1;
 
   DrmResources *drm_;
   DrmEventHandler *hotplug_handler_ = NULL;
+
+  // Sources by id rather than by fd, so an event that was pending for a
+  // removed fd can't reach a source that reused the number.
+  std::map<uint64_t, std::shared_ptr<Source>> sources_;
+  uint64_t next_source_id_ = kWakeSourceId + 1;
+  // The source whose handler is running, and on which thread
+  std::shared_ptr<Source> dispatching_;
+  pthread_t dispatch_thread_;
+
+  bool sources_initialized_ = false;
+  pthread_mutex_t sources_lock_;
+  pthread_cond_t dispatch_cond_;
 };
 }
 
@@ -22,6 +22,7 @@
 #include <sync/sync.h>
 
 #include <ui/GraphicBuffer.h>
+#include <ui/PixelFormat.h>
 
 namespace android {
 
@@ -52,9 +53,15 @@ struct DrmFramebuffer {
     release_fence_fd_ = fd;
   }
 
-  bool Allocate(uint32_t w, uint32_t h) {
+  bool Allocate(uint32_t w, uint32_t h,
+                PixelFormat format = PIXEL_FORMAT_RGBA_8888,
+                uint32_t extra_usage = 0) {
+    uint32_t usage = GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER |
+                     GRALLOC_USAGE_HW_COMPOSER | extra_usage;
     if (is_valid()) {
-      if (buffer_->getWidth() == w && buffer_->getHeight() == h)
+      if (buffer_->getWidth() == w && buffer_->getHeight() == h &&
+          buffer_->getPixelFormat() == format &&
+          (buffer_->getUsage() & usage) == usage)
         return true;
 
       if (release_fence_fd_ >= 0) {
@@ -65,9 +72,7 @@ struct DrmFramebuffer {
       }
       Clear();
     }
-    buffer_ = new GraphicBuffer(w, h, PIXEL_FORMAT_RGBA_8888,
-                                GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER |
-                                    GRALLOC_USAGE_HW_COMPOSER);
+    buffer_ = new GraphicBuffer(w, h, format, usage);
     release_fence_fd_ = -1;
     return is_valid();
   }
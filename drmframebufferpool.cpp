@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-drm-framebuffer-pool"
+
+#include "drmframebufferpool.h"
+#include "autolock.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <sync/sync.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+DrmFramebufferPool::DrmFramebufferPool()
+    : format_(PIXEL_FORMAT_RGBA_8888),
+      max_buffers_(0),
+      release_seq_(0),
+      num_allocations_(0),
+      num_preallocations_(0),
+      num_fence_waits_(0),
+      num_failures_(0) {
+}
+
+DrmFramebufferPool::~DrmFramebufferPool() {
+  if (max_buffers_)
+    pthread_mutex_destroy(&lock_);
+}
+
+int DrmFramebufferPool::Init(PixelFormat format, size_t max_buffers) {
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize framebuffer pool lock %d", ret);
+    return ret;
+  }
+  format_ = format;
+  max_buffers_ = max_buffers;
+  return 0;
+}
+
+static bool IsFenceSignaled(int fd) {
+  return fd < 0 || sync_wait(fd, 0) == 0;
+}
+
+bool DrmFramebufferPool::IsReleased(const Entry &entry) {
+  return IsFenceSignaled(entry.fb->release_fence_fd());
+}
+
+bool DrmFramebufferPool::Matches(const Entry &entry, uint32_t width,
+                                 uint32_t height, PixelFormat format,
+                                 uint32_t usage) {
+  sp<GraphicBuffer> buffer = entry.fb->buffer();
+  return buffer != NULL && buffer->getWidth() == width &&
+         buffer->getHeight() == height && buffer->getPixelFormat() == format &&
+         (buffer->getUsage() & usage) == usage;
+}
+
+bool DrmFramebufferPool::Fits(const Entry &entry, uint32_t width,
+                              uint32_t height, PixelFormat format,
+                              uint32_t usage) {
+  sp<GraphicBuffer> buffer = entry.fb->buffer();
+  return buffer != NULL && buffer->getWidth() >= width &&
+         buffer->getHeight() >= height && buffer->getPixelFormat() == format &&
+         (buffer->getUsage() & usage) == usage;
+}
+
+DrmFramebufferPool::Entry *DrmFramebufferPool::FindEntryLocked(
+    DrmFramebuffer *fb) {
+  for (auto &entry : entries_)
+    if (entry->fb.get() == fb)
+      return entry.get();
+  return NULL;
+}
+
+void DrmFramebufferPool::RetireLocked(size_t index) {
+  std::unique_ptr<DrmFramebuffer> fb = std::move(entries_[index]->fb);
+  entries_.erase(entries_.begin() + index);
+  if (!IsFenceSignaled(fb->release_fence_fd()))
+    retired_.emplace_back(std::move(fb));
+}
+
+void DrmFramebufferPool::PurgeRetiredLocked() {
+  for (auto it = retired_.begin(); it != retired_.end();) {
+    if (IsFenceSignaled((*it)->release_fence_fd()))
+      it = retired_.erase(it);
+    else
+      ++it;
+  }
+}
+
+DrmFramebuffer *DrmFramebufferPool::Get(uint32_t width, uint32_t height,
+                                        uint32_t usage) {
+  ATRACE_CALL();
+  AutoLock lock(&lock_, "framebuffer-pool");
+
+  // Two passes: if every buffer is still on screen we wait for the one that
+  // was queued first and try again.
+  for (int pass = 0; pass < 2; pass++) {
+    if (lock.Lock())
+      return NULL;
+
+    PurgeRetiredLocked();
+
+    Entry *busy = NULL;
+    Entry *best = NULL;
+    uint64_t best_area = 0;
+    int idle_index = -1;
+    for (size_t i = 0; i < entries_.size(); i++) {
+      Entry &entry = *entries_[i];
+      if (entry.in_use || entry.pinned)
+        continue;
+      if (!IsReleased(entry)) {
+        if (!busy || entry.release_seq < busy->release_seq)
+          busy = &entry;
+        continue;
+      }
+      if (Fits(entry, width, height, format_, usage)) {
+        sp<GraphicBuffer> buffer = entry.fb->buffer();
+        uint64_t area = (uint64_t)buffer->getWidth() * buffer->getHeight();
+        if (!best || area < best_area) {
+          best = &entry;
+          best_area = area;
+        }
+        continue;
+      }
+      if (idle_index < 0)
+        idle_index = i;
+    }
+
+    // The frame only covers part of a larger buffer, which is cheaper than
+    // an allocation on the compositor thread.
+    if (best) {
+      best->in_use = true;
+      best->fb->set_release_fence_fd(-1);
+      return best->fb.get();
+    }
+
+    // Idle buffers that are too small make way for the new one.
+    if (entries_.size() >= max_buffers_ && idle_index >= 0)
+      RetireLocked(idle_index);
+
+    if (entries_.size() < max_buffers_) {
+      entries_.emplace_back(new Entry);
+      Entry *entry = entries_.back().get();
+      entry->fb.reset(new DrmFramebuffer());
+      entry->in_use = true;
+      DrmFramebuffer *fb = entry->fb.get();
+      num_allocations_++;
+      lock.Unlock();
+
+      if (fb->Allocate(width, height, format_, usage))
+        return fb;
+
+      ALOGE("Failed to allocate %dx%d framebuffer", width, height);
+      if (lock.Lock())
+        return NULL;
+      for (size_t i = 0; i < entries_.size(); i++) {
+        if (entries_[i]->fb.get() == fb) {
+          entries_.erase(entries_.begin() + i);
+          break;
+        }
+      }
+      num_failures_++;
+      return NULL;
+    }
+
+    if (!busy || pass > 0)
+      break;
+
+    int fence = dup(busy->fb->release_fence_fd());
+    num_fence_waits_++;
+    lock.Unlock();
+
+    ALOGW("All %zu framebuffers are on screen, waiting for a release",
+          max_buffers_);
+    int ret = -EINVAL;
+    if (fence >= 0) {
+      ret = sync_wait(fence, DrmFramebuffer::kReleaseWaitTimeoutMs);
+      close(fence);
+    }
+    if (ret) {
+      ALOGE("Failed to wait for framebuffer release %d", ret);
+      if (lock.Lock())
+        return NULL;
+      break;
+    }
+  }
+
+  num_failures_++;
+  return NULL;
+}
+
+void DrmFramebufferPool::Put(DrmFramebuffer *fb, int release_fence_fd) {
+  AutoLock lock(&lock_, "framebuffer-pool");
+  if (lock.Lock()) {
+    if (release_fence_fd >= 0)
+      close(release_fence_fd);
+    return;
+  }
+
+  Entry *entry = FindEntryLocked(fb);
+  if (!entry) {
+    ALOGE("Framebuffer %p does not belong to this pool", fb);
+    if (release_fence_fd >= 0)
+      close(release_fence_fd);
+    return;
+  }
+  entry->fb->set_release_fence_fd(release_fence_fd);
+  entry->release_seq = ++release_seq_;
+  entry->in_use = false;
+}
+
+void DrmFramebufferPool::SetReleaseFence(DrmFramebuffer *fb,
+                                         int release_fence_fd) {
+  AutoLock lock(&lock_, "framebuffer-pool");
+  if (lock.Lock()) {
+    if (release_fence_fd >= 0)
+      close(release_fence_fd);
+    return;
+  }
+
+  Entry *entry = FindEntryLocked(fb);
+  if (!entry) {
+    if (release_fence_fd >= 0)
+      close(release_fence_fd);
+    return;
+  }
+  entry->fb->set_release_fence_fd(release_fence_fd);
+  entry->release_seq = ++release_seq_;
+}
+
+void DrmFramebufferPool::Pin(DrmFramebuffer *fb, bool pinned) {
+  AutoLock lock(&lock_, "framebuffer-pool");
+  if (lock.Lock())
+    return;
+
+  Entry *entry = FindEntryLocked(fb);
+  if (entry)
+    entry->pinned = pinned;
+}
+
+bool DrmFramebufferPool::IsFull() const {
+  AutoLock lock(&lock_, "framebuffer-pool");
+  if (lock.Lock())
+    return true;
+  return entries_.size() >= max_buffers_;
+}
+
+void DrmFramebufferPool::Preallocate(uint32_t width, uint32_t height,
+                                     uint32_t usage, size_t count, bool trim) {
+  ATRACE_CALL();
+  AutoLock lock(&lock_, "framebuffer-pool");
+  if (lock.Lock())
+    return;
+
+  // Buffers that don't fit the new mode will never be handed out again.
+  for (size_t i = 0; trim && i < entries_.size();) {
+    const Entry &entry = *entries_[i];
+    sp<GraphicBuffer> buffer = entry.fb->buffer();
+    if (!entry.in_use && !entry.pinned && buffer != NULL &&
+        (buffer->getWidth() > width || buffer->getHeight() > height))
+      RetireLocked(i);
+    else
+      i++;
+  }
+
+  size_t num_ready = 0;
+  for (auto &entry : entries_)
+    if (Matches(*entry, width, height, format_, usage))
+      num_ready++;
+
+  std::vector<DrmFramebuffer *> allocate;
+  while (num_ready + allocate.size() < count &&
+         entries_.size() < max_buffers_) {
+    entries_.emplace_back(new Entry);
+    entries_.back()->fb.reset(new DrmFramebuffer());
+    entries_.back()->in_use = true;
+    allocate.push_back(entries_.back()->fb.get());
+  }
+  lock.Unlock();
+
+  std::vector<bool> allocated;
+  for (DrmFramebuffer *fb : allocate)
+    allocated.push_back(fb->Allocate(width, height, format_, usage));
+
+  if (lock.Lock())
+    return;
+  for (size_t i = 0; i < allocate.size(); i++) {
+    for (size_t j = 0; j < entries_.size(); j++) {
+      if (entries_[j]->fb.get() != allocate[i])
+        continue;
+      if (allocated[i]) {
+        entries_[j]->in_use = false;
+        num_preallocations_++;
+      } else {
+        ALOGE("Failed to preallocate %dx%d framebuffer", width, height);
+        entries_.erase(entries_.begin() + j);
+        num_failures_++;
+      }
+      break;
+    }
+  }
+}
+
+void DrmFramebufferPool::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "framebuffer-pool");
+  if (lock.Lock())
+    return;
+
+  *out << "    format=" << format_ << " buffers=" << entries_.size() << "/"
+       << max_buffers_ << " retired=" << retired_.size()
+       << " allocations=" << num_allocations_
+       << " preallocations=" << num_preallocations_
+       << " fence_waits=" << num_fence_waits_
+       << " failures=" << num_failures_ << "\n";
+  for (const auto &entry : entries_) {
+    sp<GraphicBuffer> buffer = entry->fb->buffer();
+    *out << "      ";
+    if (buffer != NULL)
+      *out << buffer->getWidth() << "x" << buffer->getHeight();
+    else
+      *out << "unallocated";
+    *out << (entry->in_use ? " in_use" : "") << (entry->pinned ? " pinned" : "")
+         << " release_fence=" << entry->fb->release_fence_fd() << "\n";
+  }
+}
+
+DrmFramebufferAllocator::DrmFramebufferAllocator()
+    : Worker("framebuffer-allocator", HAL_PRIORITY_URGENT_DISPLAY) {
+}
+
+DrmFramebufferAllocator::~DrmFramebufferAllocator() {
+}
+
+int DrmFramebufferAllocator::Init() {
+  return InitWorker();
+}
+
+void DrmFramebufferAllocator::QueuePreallocate(DrmFramebufferPool *pool,
+                                               uint32_t width, uint32_t height,
+                                               uint32_t usage, size_t count,
+                                               bool trim) {
+  Lock();
+  requests_.push(Request{pool, width, height, usage, count, trim});
+  SignalLocked();
+  Unlock();
+}
+
+void DrmFramebufferAllocator::Routine() {
+  int ret = Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+
+  int wait_ret = 0;
+  if (requests_.empty())
+    wait_ret = WaitForSignalOrExitLocked();
+
+  bool have_request = !requests_.empty();
+  Request request;
+  if (have_request) {
+    request = requests_.front();
+    requests_.pop();
+  }
+
+  ret = Unlock();
+  if (ret) {
+    ALOGE("Failed to unlock worker, %d", ret);
+    return;
+  }
+
+  if (wait_ret == -EINTR) {
+    return;
+  } else if (wait_ret) {
+    ALOGE("Failed to wait for signal, %d", wait_ret);
+    return;
+  }
+
+  if (have_request)
+    request.pool->Preallocate(request.width, request.height, request.usage,
+                              request.count, request.trim);
+}
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_FRAMEBUFFER_POOL_H_
+#define ANDROID_DRM_FRAMEBUFFER_POOL_H_
+
+#include "drmframebuffer.h"
+#include "worker.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <vector>
+
+#include <ui/PixelFormat.h>
+
+namespace android {
+
+// A set of framebuffers of one pixel format. Buffers are handed out based on
+// their release fences rather than in a fixed order, so the compositor only
+// ever blocks on a fence when every buffer in the pool is still on screen.
+//
+// A buffer is owned by the caller between Get() and Put(). Pinned buffers are
+// never recycled, which is used to keep the squash framebuffer around while
+// it can still be scanned out again.
+class DrmFramebufferPool {
+ public:
+  DrmFramebufferPool();
+  ~DrmFramebufferPool();
+
+  int Init(PixelFormat format, size_t max_buffers);
+
+  // Returns a framebuffer of at least w x h that is no longer being scanned
+  // out, or NULL if none could be found or allocated. The smallest one that
+  // fits is preferred. A buffer is only allocated here if none fits.
+  DrmFramebuffer *Get(uint32_t width, uint32_t height, uint32_t usage);
+
+  // Returns |fb| to the pool. It won't be handed out again until
+  // |release_fence_fd| signals. Ownership of the fd is transferred.
+  void Put(DrmFramebuffer *fb, int release_fence_fd);
+
+  // Replaces the release fence of a buffer that is already in the pool, used
+  // when a pinned buffer is scanned out again.
+  void SetReleaseFence(DrmFramebuffer *fb, int release_fence_fd);
+
+  void Pin(DrmFramebuffer *fb, bool pinned);
+
+  // Whether the pool holds as many buffers as it may
+  bool IsFull() const;
+
+  // Makes sure |count| w x h buffers are ready to be handed out, as far as
+  // the pool has room. With |trim|, e.g. after a mode change, idle buffers
+  // that are larger than w x h are retired first. This may block on
+  // allocation so it should be called from DrmFramebufferAllocator.
+  void Preallocate(uint32_t width, uint32_t height, uint32_t usage,
+                   size_t count, bool trim);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  struct Entry {
+    std::unique_ptr<DrmFramebuffer> fb;
+    bool in_use = false;
+    bool pinned = false;
+    uint64_t release_seq = 0;
+  };
+
+  static bool IsReleased(const Entry &entry);
+  static bool Matches(const Entry &entry, uint32_t width, uint32_t height,
+                      PixelFormat format, uint32_t usage);
+  static bool Fits(const Entry &entry, uint32_t width, uint32_t height,
+                   PixelFormat format, uint32_t usage);
+
+  Entry *FindEntryLocked(DrmFramebuffer *fb);
+  void RetireLocked(size_t index);
+  void PurgeRetiredLocked();
+
+  PixelFormat format_;
+  size_t max_buffers_;
+
+  std::vector<std::unique_ptr<Entry>> entries_;
+  // Buffers that were dropped from the pool while still on screen. They are
+  // freed once their release fence signals.
+  std::vector<std::unique_ptr<DrmFramebuffer>> retired_;
+  uint64_t release_seq_;
+
+  mutable pthread_mutex_t lock_;
+
+  // Statistics, protected by lock_
+  uint64_t num_allocations_;
+  uint64_t num_preallocations_;
+  uint64_t num_fence_waits_;
+  uint64_t num_failures_;
+};
+
+// Fills framebuffer pools in the background, so that a modeset doesn't stall
+// the next frame on buffer allocation.
+class DrmFramebufferAllocator : public Worker {
+ public:
+  DrmFramebufferAllocator();
+  ~DrmFramebufferAllocator() override;
+
+  int Init();
+  void QueuePreallocate(DrmFramebufferPool *pool, uint32_t width,
+                        uint32_t height, uint32_t usage, size_t count,
+                        bool trim);
+
+ protected:
+  void Routine() override;
+
+ private:
+  struct Request {
+    DrmFramebufferPool *pool;
+    uint32_t width;
+    uint32_t height;
+    uint32_t usage;
+    size_t count;
+    bool trim;
+  };
+
+  std::queue<Request> requests_;
+};
+}
+
+#endif  // ANDROID_DRM_FRAMEBUFFER_POOL_H_
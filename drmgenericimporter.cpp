@@ -17,6 +17,7 @@
 #define LOG_TAG "hwc-drm-generic-importer"
 
 #include "importer.h"
+#include "autolock.h"
 #include "drmresources.h"
 #include "drmgenericimporter.h"
 
@@ -47,10 +48,13 @@ Importer *Importer::CreateInstance(DrmResources *drm) {
 }
 #endif
 
-DrmGenericImporter::DrmGenericImporter(DrmResources *drm) : drm_(drm) {
+DrmGenericImporter::DrmGenericImporter(DrmResources *drm)
+    : drm_(drm), initialized_(false) {
 }
 
 DrmGenericImporter::~DrmGenericImporter() {
+  if (initialized_)
+    pthread_mutex_destroy(&lock_);
 }
 
 int DrmGenericImporter::Init() {
@@ -60,6 +64,13 @@ int DrmGenericImporter::Init() {
     ALOGE("Failed to open gralloc module");
     return ret;
   }
+
+  ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize importer lock %d", ret);
+    return ret;
+  }
+  initialized_ = true;
   return 0;
 }
 
@@ -88,8 +99,15 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   if (!gr_handle)
     return -EINVAL;
 
+  // Held across the prime import so that the GEM handle can't be closed by a
+  // concurrent release of the last reference to the same buffer.
+  AutoLock lock(&lock_, "importer");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
   uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
+  ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
   if (ret) {
     ALOGE("failed to import prime fd %d ret=%d", gr_handle->prime_fd, ret);
     return ret;
@@ -103,6 +121,17 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   bo->gem_handles[0] = gem_handle;
   bo->offsets[0] = 0;
 
+  auto it = buffers_.find(gem_handle);
+  if (it != buffers_.end()) {
+    const hwc_drm_bo_t &cached = it->second.bo;
+    if (cached.width == bo->width && cached.height == bo->height &&
+        cached.format == bo->format && cached.pitches[0] == bo->pitches[0]) {
+      it->second.refs++;
+      *bo = cached;
+      return 0;
+    }
+  }
+
   ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
                       bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
   if (ret) {
@@ -110,14 +139,40 @@ int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
     return ret;
   }
 
+  // A buffer that is imported with a different layout than before gets a
+  // framebuffer of its own. The GEM handle stays with the cached one.
+  if (it != buffers_.end())
+    return ret;
+
+  CachedBuffer &entry = buffers_[gem_handle];
+  bo->priv = &entry;
+  entry.bo = *bo;
+  entry.refs = 1;
   return ret;
 }
 
 int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
+  AutoLock lock(&lock_, "importer");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  CachedBuffer *entry = (CachedBuffer *)bo->priv;
+  if (entry && --entry->refs > 0) {
+    memset(bo, 0, sizeof(hwc_drm_bo_t));
+    return 0;
+  }
+
   if (bo->fb_id)
     if (drmModeRmFB(drm_->fd(), bo->fb_id))
       ALOGE("Failed to rm fb");
 
+  if (!entry) {
+    memset(bo, 0, sizeof(hwc_drm_bo_t));
+    return 0;
+  }
+  buffers_.erase(bo->gem_handles[0]);
+
   struct drm_gem_close gem_close;
   memset(&gem_close, 0, sizeof(gem_close));
   int num_gem_handles = sizeof(bo->gem_handles) / sizeof(bo->gem_handles[0]);
@@ -126,7 +181,7 @@ int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
       continue;
 
     gem_close.handle = bo->gem_handles[i];
-    int ret = drmIoctl(drm_->fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
+    ret = drmIoctl(drm_->fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
     if (ret)
       ALOGE("Failed to close gem handle %d %d", i, ret);
     else
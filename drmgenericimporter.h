@@ -20,6 +20,9 @@
 #include "drmresources.h"
 #include "importer.h"
 
+#include <pthread.h>
+#include <map>
+
 #include <hardware/gralloc.h>
 
 namespace android {
@@ -37,9 +40,22 @@ class DrmGenericImporter : public Importer {
  private:
   uint32_t ConvertHalFormatToDrm(uint32_t hal_format);
 
+  // SurfaceFlinger hands us the same few buffers over and over, so the
+  // framebuffer created for a buffer is shared by all of its imports and only
+  // removed once the last of them is released. Keyed by GEM handle, which the
+  // kernel hands out once per buffer no matter how often it is imported.
+  struct CachedBuffer {
+    hwc_drm_bo_t bo;
+    unsigned refs = 0;
+  };
+
   DrmResources *drm_;
 
   const gralloc_module_t *gralloc_;
+
+  std::map<uint32_t, CachedBuffer> buffers_;
+  pthread_mutex_t lock_;
+  bool initialized_;
 };
 }
 
@@ -126,6 +126,21 @@ float DrmMode::v_refresh() const {
                       clock_ / (float)(v_total_ * h_total_) * 1000.0f;
 }
 
+int64_t DrmMode::frame_period_ns() const {
+  if (!clock_ || !h_total_ || !v_total_)
+    return v_refresh_ ? 1000LL * 1000 * 1000 / v_refresh_ : 0;
+
+  // The clock is in kHz
+  int64_t period_ns = (int64_t)h_total_ * v_total_ * 1000 * 1000 / clock_;
+  if (flags_ & DRM_MODE_FLAG_INTERLACE)
+    period_ns /= 2;
+  if (flags_ & DRM_MODE_FLAG_DBLSCAN)
+    period_ns *= 2;
+  if (v_scan_ > 1)
+    period_ns *= v_scan_;
+  return period_ns;
+}
+
 uint32_t DrmMode::flags() const {
   return flags_;
 }
@@ -48,6 +48,9 @@ class DrmMode {
   uint32_t v_total() const;
   uint32_t v_scan() const;
   float v_refresh() const;
+  // From the pixel clock, unlike v_refresh() this isn't rounded, e.g. for
+  // 59.94Hz modes. 0 if the mode doesn't tell.
+  int64_t frame_period_ns() const;
 
   uint32_t flags() const;
   uint32_t type() const;
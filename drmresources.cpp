@@ -195,6 +195,10 @@ int DrmResources::Init() {
   if (ret)
     return ret;
 
+  ret = property_shadow_.Init();
+  if (ret)
+    return ret;
+
   ret = compositor_.Init();
   if (ret)
     return ret;
@@ -378,6 +382,10 @@ DrmEventListener *DrmResources::event_listener() {
   return &event_listener_;
 }
 
+DrmPropertyShadow *DrmResources::property_shadow() {
+  return &property_shadow_;
+}
+
 int DrmResources::GetProperty(uint32_t obj_id, uint32_t obj_type,
                               const char *prop_name, DrmProperty *property) {
   drmModeObjectPropertiesPtr props;
@@ -17,6 +17,7 @@
 #ifndef ANDROID_DRM_H_
 #define ANDROID_DRM_H_
 
+#include "drmatomicrequest.h"
 #include "drmcompositor.h"
 #include "drmconnector.h"
 #include "drmcrtc.h"
@@ -52,6 +53,7 @@ class DrmResources {
   DrmPlane *GetPlane(uint32_t id) const;
   DrmCompositor *compositor();
   DrmEventListener *event_listener();
+  DrmPropertyShadow *property_shadow();
 
   int GetPlaneProperty(const DrmPlane &plane, const char *prop_name,
                        DrmProperty *property);
@@ -81,6 +83,8 @@ class DrmResources {
   std::vector<std::unique_ptr<DrmEncoder>> encoders_;
   std::vector<std::unique_ptr<DrmCrtc>> crtcs_;
   std::vector<std::unique_ptr<DrmPlane>> planes_;
+  // Outlives the compositors, which commit against it
+  DrmPropertyShadow property_shadow_;
   DrmCompositor compositor_;
   DrmEventListener event_listener_;
 };
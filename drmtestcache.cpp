@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-test-cache"
+
+#include "drmtestcache.h"
+#include "autolock.h"
+#include "drmcrtc.h"
+#include "drmdisplaycomposition.h"
+#include "drmplane.h"
+
+#include <errno.h>
+
+#include <cutils/log.h>
+
+namespace android {
+
+DrmTestCache::DrmTestCache()
+    : num_hits_(0), num_misses_(0), num_clears_(0), initialized_(false) {
+}
+
+DrmTestCache::~DrmTestCache() {
+  if (initialized_)
+    pthread_mutex_destroy(&lock_);
+}
+
+int DrmTestCache::Init() {
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize test cache lock %d", ret);
+    return ret;
+  }
+  initialized_ = true;
+  return 0;
+}
+
+static uint64_t Pack(int32_t high, int32_t low) {
+  return ((uint64_t)(uint32_t)high << 32) | (uint32_t)low;
+}
+
+// Source coordinates are sent as 16.16 fixed point, compare them as such
+static int32_t ToFixed(float value) {
+  return (int32_t)value << 16;
+}
+
+// static
+void DrmTestCache::GetSignature(DrmDisplayComposition *display_comp,
+                                Signature *signature) {
+  std::vector<DrmHwcLayer> &layers = display_comp->layers();
+
+  signature->clear();
+  for (DrmCompositionPlane &comp_plane : display_comp->composition_planes()) {
+    signature->push_back(Pack(comp_plane.plane->id(),
+                              comp_plane.crtc ? comp_plane.crtc->id() : 0));
+
+    if (comp_plane.source_layer >= layers.size() ||
+        !layers[comp_plane.source_layer].buffer) {
+      signature->push_back(0);
+      continue;
+    }
+
+    DrmHwcLayer &layer = layers[comp_plane.source_layer];
+    signature->push_back(Pack(layer.buffer->format, layer.buffer->pitches[0]));
+    signature->push_back(Pack(layer.buffer->width, layer.buffer->height));
+    signature->push_back(
+        Pack(layer.display_frame.left, layer.display_frame.top));
+    signature->push_back(
+        Pack(layer.display_frame.right, layer.display_frame.bottom));
+    signature->push_back(Pack(ToFixed(layer.source_crop.left),
+                              ToFixed(layer.source_crop.top)));
+    signature->push_back(Pack(ToFixed(layer.source_crop.right),
+                              ToFixed(layer.source_crop.bottom)));
+    signature->push_back(Pack(layer.transform, (int32_t)layer.blending));
+    signature->push_back(layer.alpha);
+  }
+}
+
+bool DrmTestCache::Lookup(const Signature &signature, int *result) {
+  AutoLock lock(&lock_, "test-cache");
+  if (lock.Lock())
+    return false;
+
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->signature != signature)
+      continue;
+    *result = it->result;
+    entries_.splice(entries_.begin(), entries_, it);
+    num_hits_++;
+    return true;
+  }
+  num_misses_++;
+  return false;
+}
+
+void DrmTestCache::Insert(const Signature &signature, int result) {
+  // Only the kernel turning a configuration down is worth remembering, not
+  // running out of memory or being interrupted.
+  if (result && result != -EINVAL)
+    return;
+
+  AutoLock lock(&lock_, "test-cache");
+  if (lock.Lock())
+    return;
+
+  entries_.push_front({signature, result});
+  if (entries_.size() > kMaxEntries)
+    entries_.pop_back();
+}
+
+void DrmTestCache::Clear() {
+  AutoLock lock(&lock_, "test-cache");
+  if (lock.Lock())
+    return;
+
+  entries_.clear();
+  num_clears_++;
+}
+
+void DrmTestCache::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "test-cache");
+  if (lock.Lock())
+    return;
+
+  *out << "  Test cache: entries=" << entries_.size() << " hits=" << num_hits_
+       << " misses=" << num_misses_ << " clears=" << num_clears_ << "\n";
+}
+}
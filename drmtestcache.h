@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_TEST_CACHE_H_
+#define ANDROID_DRM_TEST_CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <list>
+#include <sstream>
+#include <vector>
+
+namespace android {
+
+class DrmDisplayComposition;
+
+// Remembers what the kernel said about recent TEST_ONLY commits. The same
+// plane layouts keep coming back (home screen, notification shade, video
+// with controls), so most of them can be answered without the ioctl.
+//
+// Entries are keyed by the plane configuration of a composition with the
+// framebuffers themselves left out, i.e. everything the kernel checks
+// besides whether the buffers exist. The mode isn't part of the key, so the
+// cache has to be cleared whenever the display is reconfigured.
+class DrmTestCache {
+ public:
+  typedef std::vector<uint64_t> Signature;
+
+  DrmTestCache();
+  ~DrmTestCache();
+
+  int Init();
+
+  static void GetSignature(DrmDisplayComposition *display_comp,
+                           Signature *signature);
+
+  // Returns true and sets |result| if |signature| was tested before
+  bool Lookup(const Signature &signature, int *result);
+  void Insert(const Signature &signature, int result);
+  void Clear();
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  struct Entry {
+    Signature signature;
+    int result;
+  };
+
+  // Covers the handful of layouts a device cycles through, small enough that
+  // a linear search is cheaper than hashing the signature.
+  static const size_t kMaxEntries = 16;
+
+  // Most recently used first
+  std::list<Entry> entries_;
+
+  uint64_t num_hits_;
+  uint64_t num_misses_;
+  uint64_t num_clears_;
+
+  bool initialized_;
+  mutable pthread_mutex_t lock_;
+};
+}
+
+#endif  // ANDROID_DRM_TEST_CACHE_H_
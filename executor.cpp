@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-executor"
+
+#include "executor.h"
+#include "autolock.h"
+#include "drmeventlistener.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <cutils/log.h>
+
+namespace android {
+
+static const int64_t kBillion = 1000000000LL;
+
+static int64_t Now() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * kBillion + ts.tv_nsec;
+}
+
+Executor::Executor()
+    : loop_(NULL),
+      num_tasks_(0),
+      num_timers_(0),
+      running_(false),
+      initialized_(false),
+      exited_(false) {
+}
+
+Executor::~Executor() {
+  if (!initialized_)
+    return;
+  Exit();
+  pthread_cond_destroy(&idle_cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+int Executor::Init(DrmEventListener *loop) {
+  loop_ = loop;
+
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize executor lock %d", ret);
+    return ret;
+  }
+  ret = pthread_cond_init(&idle_cond_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize executor condition %d", ret);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+  initialized_ = true;
+
+  event_fd_.Set(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (event_fd_.get() < 0) {
+    ALOGE("Failed to create executor eventfd %d", -errno);
+    return -errno;
+  }
+
+  timer_fd_.Set(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+  if (timer_fd_.get() < 0) {
+    ALOGE("Failed to create executor timerfd %d", -errno);
+    return -errno;
+  }
+
+  ret = loop_->AddFd(event_fd_.get(), EPOLLIN,
+                     [this](int, uint32_t, int64_t) { RunTasks(); });
+  if (ret)
+    return ret;
+
+  ret = loop_->AddFd(
+      timer_fd_.get(), EPOLLIN,
+      [this](int, uint32_t, int64_t timestamp_ns) { RunTimers(timestamp_ns); });
+  if (ret) {
+    loop_->RemoveFd(event_fd_.get());
+    return ret;
+  }
+  return 0;
+}
+
+void Executor::Exit() {
+  std::vector<int> fds;
+  {
+    AutoLock lock(&lock_, "executor");
+    if (lock.Lock())
+      return;
+    if (exited_)
+      return;
+    exited_ = true;
+    tasks_.clear();
+    timers_.clear();
+    fds.assign(waits_.begin(), waits_.end());
+    waits_.clear();
+  }
+
+  if (event_fd_.get() >= 0)
+    loop_->RemoveFd(event_fd_.get());
+  if (timer_fd_.get() >= 0)
+    loop_->RemoveFd(timer_fd_.get());
+  for (int fd : fds)
+    loop_->RemoveFd(fd);
+
+  // A wait task is off the loop's books by the time it runs, so removing the
+  // fds doesn't wait for it. A task that calls Exit() is left to finish.
+  AutoLock lock(&lock_, "executor");
+  if (lock.Lock())
+    return;
+  while (running_ && !pthread_equal(running_thread_, pthread_self()))
+    pthread_cond_wait(&idle_cond_, &lock_);
+}
+
+bool Executor::BeginTask() {
+  AutoLock lock(&lock_, "executor");
+  if (lock.Lock() || exited_)
+    return false;
+  running_ = true;
+  running_thread_ = pthread_self();
+  return true;
+}
+
+void Executor::EndTask() {
+  AutoLock lock(&lock_, "executor");
+  if (lock.Lock())
+    return;
+  running_ = false;
+  pthread_cond_broadcast(&idle_cond_);
+}
+
+int Executor::Post(Task task) {
+  AutoLock lock(&lock_, "executor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  if (exited_ || !loop_)
+    return -EINVAL;
+
+  bool was_empty = tasks_.empty();
+  tasks_.emplace_back(std::move(task));
+  if (!was_empty)
+    return 0;
+
+  uint64_t value = 1;
+  if (write(event_fd_.get(), &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    ALOGE("Failed to wake executor %d", -errno);
+    return -errno;
+  }
+  return 0;
+}
+
+int Executor::PostDelayed(int64_t delay_ns, Task task) {
+  AutoLock lock(&lock_, "executor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  if (exited_ || !loop_)
+    return -EINVAL;
+
+  auto it = timers_.emplace(Now() + delay_ns, std::move(task));
+  if (it != timers_.begin())
+    return 0;
+  return ArmTimerLocked();
+}
+
+int Executor::PostWhenReadable(int fd, int timeout_ms, WaitTask task) {
+  {
+    AutoLock lock(&lock_, "executor");
+    int ret = lock.Lock();
+    if (ret)
+      return ret;
+    if (exited_ || !loop_)
+      return -EINVAL;
+    waits_.insert(fd);
+  }
+
+  // Whichever of the two comes first runs the task. Both run on the loop
+  // thread, so the flag needs no lock. The timeout is already bracketed as a
+  // timer, the readable callback brackets the task itself.
+  std::shared_ptr<bool> done = std::make_shared<bool>(false);
+  std::shared_ptr<WaitTask> shared_task =
+      std::make_shared<WaitTask>(std::move(task));
+
+  int ret = loop_->AddFd(fd, EPOLLIN,
+                         [this, done, shared_task, fd](int, uint32_t, int64_t) {
+                           if (*done)
+                             return;
+                           *done = true;
+                           FinishWait(fd);
+                           if (!BeginTask())
+                             return;
+                           (*shared_task)(0);
+                           EndTask();
+                         });
+  if (ret) {
+    AutoLock lock(&lock_, "executor");
+    if (!lock.Lock())
+      waits_.erase(fd);
+    return ret;
+  }
+
+  ret = PostDelayed((int64_t)timeout_ms * 1000 * 1000,
+                    [this, done, shared_task, fd]() {
+                      if (*done)
+                        return;
+                      *done = true;
+                      FinishWait(fd);
+                      (*shared_task)(-ETIMEDOUT);
+                    });
+  if (ret) {
+    // Without the timeout it still works, it just might wait forever
+    ALOGE("Failed to set wait timeout %d", ret);
+  }
+  return 0;
+}
+
+void Executor::FinishWait(int fd) {
+  {
+    AutoLock lock(&lock_, "executor");
+    if (lock.Lock())
+      return;
+    if (!waits_.erase(fd))
+      return;
+  }
+  loop_->RemoveFd(fd);
+}
+
+int Executor::ArmTimerLocked() {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (!timers_.empty()) {
+    // A zero expiration would disarm the timer
+    int64_t deadline_ns = std::max(timers_.begin()->first, (int64_t)1);
+    spec.it_value.tv_sec = deadline_ns / kBillion;
+    spec.it_value.tv_nsec = deadline_ns % kBillion;
+  }
+  int ret = timerfd_settime(timer_fd_.get(), TFD_TIMER_ABSTIME, &spec, NULL);
+  if (ret) {
+    ALOGE("Failed to arm executor timer %d", -errno);
+    return -errno;
+  }
+  return 0;
+}
+
+void Executor::RunTasks() {
+  uint64_t value;
+  if (read(event_fd_.get(), &value, sizeof(value)) < 0 && errno != EAGAIN)
+    ALOGE("Failed to read executor eventfd %d", -errno);
+
+  std::deque<Task> tasks;
+  {
+    AutoLock lock(&lock_, "executor");
+    if (lock.Lock())
+      return;
+    tasks.swap(tasks_);
+    num_tasks_ += tasks.size();
+  }
+
+  for (Task &task : tasks) {
+    if (!BeginTask())
+      return;
+    task();
+    EndTask();
+  }
+}
+
+void Executor::RunTimers(int64_t now_ns) {
+  uint64_t expirations;
+  if (read(timer_fd_.get(), &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    ALOGE("Failed to read executor timerfd %d", -errno);
+
+  std::vector<Task> tasks;
+  {
+    AutoLock lock(&lock_, "executor");
+    if (lock.Lock())
+      return;
+    auto end = timers_.upper_bound(now_ns);
+    for (auto it = timers_.begin(); it != end; ++it)
+      tasks.emplace_back(std::move(it->second));
+    timers_.erase(timers_.begin(), end);
+    num_timers_ += tasks.size();
+    ArmTimerLocked();
+  }
+
+  for (Task &task : tasks) {
+    if (!BeginTask())
+      return;
+    task();
+    EndTask();
+  }
+}
+
+void Executor::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "executor");
+  if (lock.Lock())
+    return;
+
+  *out << "tasks=" << num_tasks_ << " timers=" << num_timers_
+       << " pending=" << tasks_.size() << " pending_timers=" << timers_.size()
+       << " waits=" << waits_.size();
+}
+}
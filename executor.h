@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_EXECUTOR_H_
+#define ANDROID_EXECUTOR_H_
+
+#include "autofd.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
+
+namespace android {
+
+class DrmEventListener;
+
+// Runs tasks on the thread of a DrmEventListener rather than on a thread of
+// their own. Work that mostly waits, e.g. for fences or timers, costs a
+// wakeup of the event loop instead of a sleeping thread with its own stack.
+//
+// Tasks posted to the same executor run one at a time, in the order they
+// were posted. They share the loop with everything else on it, so they must
+// not block.
+class Executor {
+ public:
+  typedef std::function<void()> Task;
+  // Told 0 once the fd is readable, or -ETIMEDOUT
+  typedef std::function<void(int result)> WaitTask;
+
+  Executor();
+  ~Executor();
+
+  int Init(DrmEventListener *loop);
+  // Stops running tasks and drops the ones still pending. Once this returns
+  // no task is running, unless it's called from a task.
+  void Exit();
+
+  // These can be called from any thread, tasks included
+  int Post(Task task);
+  int PostDelayed(int64_t delay_ns, Task task);
+  // Runs |task| once |fd| is readable, such as a sync fence that signaled, or
+  // after |timeout_ms| if that comes first. |fd| stays owned by the caller and
+  // has to stay open until the task runs.
+  int PostWhenReadable(int fd, int timeout_ms, WaitTask task);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  void RunTasks();
+  void RunTimers(int64_t now_ns);
+  // Bracket every task. BeginTask() returns false once Exit() was called, the
+  // task must not run then.
+  bool BeginTask();
+  void EndTask();
+  // Must be called with lock_ held
+  int ArmTimerLocked();
+  void FinishWait(int fd);
+
+  DrmEventListener *loop_;
+  UniqueFd event_fd_;
+  UniqueFd timer_fd_;
+
+  std::deque<Task> tasks_;
+  // By CLOCK_MONOTONIC deadline
+  std::multimap<int64_t, Task> timers_;
+  // fds added to the loop by PostWhenReadable()
+  std::set<int> waits_;
+
+  uint64_t num_tasks_;
+  uint64_t num_timers_;
+
+  // A task is running on running_thread_, Exit() waits for it on idle_cond_
+  bool running_;
+  pthread_t running_thread_;
+
+  bool initialized_;
+  bool exited_;
+  mutable pthread_mutex_t lock_;
+  pthread_cond_t idle_cond_;
+};
+}
+
+#endif  // ANDROID_EXECUTOR_H_
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-frame-scheduler"
+
+#include "framescheduler.h"
+#include "autolock.h"
+#include "vsyncmodel.h"
+
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include <cutils/log.h>
+
+namespace android {
+
+static const int64_t kOneSecondNs = 1000 * 1000 * 1000LL;
+
+FrameScheduler::FrameScheduler()
+    : vsync_model_(NULL),
+      period_ns_(0),
+      margin_ns_(0),
+      latch_phase_ns_(0),
+      adaptive_margin_ns_(0),
+      last_vblank_ns_(0),
+      pending_target_ns_(0),
+      num_flips_(0),
+      num_missed_(0),
+      initialized_(false) {
+  for (int i = 0; i < kNumStages; i++) {
+    num_samples_[i] = 0;
+    next_sample_[i] = 0;
+  }
+}
+
+FrameScheduler::~FrameScheduler() {
+  if (initialized_)
+    pthread_mutex_destroy(&lock_);
+}
+
+int FrameScheduler::Init() {
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize frame scheduler lock %d", ret);
+    return ret;
+  }
+  initialized_ = true;
+  return 0;
+}
+
+// static
+int64_t FrameScheduler::Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kOneSecondNs + ts.tv_nsec;
+}
+
+void FrameScheduler::SetRefreshRate(float refresh_hz) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+
+  // Without a usable rate there is nothing to predict with
+  if (!isfinite(refresh_hz) || refresh_hz < 1.0f)
+    period_ns_ = 0;
+  else
+    period_ns_ = kOneSecondNs / refresh_hz;
+  last_vblank_ns_ = 0;
+  pending_target_ns_ = 0;
+  adaptive_margin_ns_ = 0;
+}
+
+void FrameScheduler::SetMargin(int64_t margin_ns) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+  margin_ns_ = margin_ns;
+}
+
+void FrameScheduler::SetLatchPhase(int64_t phase_ns) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+  latch_phase_ns_ = phase_ns;
+}
+
+void FrameScheduler::SetVSyncModel(const VSyncModel *model) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+  vsync_model_ = model;
+}
+
+bool FrameScheduler::CanPredictLocked(int64_t now_ns) const {
+  if (vsync_model_ && vsync_model_->locked())
+    return true;
+  // Stale history is as good as none, the display may have been off
+  return period_ns_ && last_vblank_ns_ &&
+         now_ns - last_vblank_ns_ <= kOneSecondNs;
+}
+
+int64_t FrameScheduler::PredictVblankLocked(int64_t after_ns) const {
+  int64_t vsync_ns;
+  if (vsync_model_ && vsync_model_->PredictNext(after_ns, &vsync_ns))
+    return vsync_ns;
+
+  // The model can lose lock between the checks
+  if (!period_ns_)
+    return after_ns;
+  if (after_ns <= last_vblank_ns_)
+    return last_vblank_ns_;
+  int64_t periods = (after_ns - last_vblank_ns_ + period_ns_ - 1) / period_ns_;
+  return last_vblank_ns_ + periods * period_ns_;
+}
+
+int64_t FrameScheduler::PeriodLocked() const {
+  if (vsync_model_ && vsync_model_->locked())
+    return vsync_model_->period_ns();
+  return period_ns_;
+}
+
+void FrameScheduler::OnCommit(int64_t timestamp_ns) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+  if (CanPredictLocked(timestamp_ns))
+    pending_target_ns_ = PredictVblankLocked(timestamp_ns);
+}
+
+void FrameScheduler::OnFlip(int64_t timestamp_ns) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+
+  // A miss buys the following frames a sixteenth of a period more, up to a
+  // quarter. Each frame that makes it gives back 1/32 of what's left.
+  if (pending_target_ns_) {
+    int64_t period_ns = PeriodLocked();
+    if (timestamp_ns > pending_target_ns_ + period_ns / 2) {
+      num_missed_++;
+      adaptive_margin_ns_ =
+          std::min(adaptive_margin_ns_ + period_ns / 16, period_ns / 4);
+    } else {
+      adaptive_margin_ns_ -= adaptive_margin_ns_ / 32;
+    }
+  }
+  pending_target_ns_ = 0;
+  last_vblank_ns_ = timestamp_ns;
+  num_flips_++;
+}
+
+void FrameScheduler::RecordStage(Stage stage, int64_t duration_ns) {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+
+  samples_[stage][next_sample_[stage]] = duration_ns;
+  next_sample_[stage] = (next_sample_[stage] + 1) % kNumSamples;
+  num_samples_[stage] = std::min(num_samples_[stage] + 1, kNumSamples);
+}
+
+// Uses the 90th percentile of recent samples, the odd slow frame shouldn't
+// push every later frame a whole vblank back.
+int64_t FrameScheduler::EstimateLocked(Stage stage) const {
+  int count = num_samples_[stage];
+  if (!count)
+    return 0;
+
+  int64_t sorted[kNumSamples];
+  std::copy(samples_[stage], samples_[stage] + count, sorted);
+  int index = (count * 9) / 10;
+  std::nth_element(sorted, sorted + index, sorted + count);
+  return sorted[index];
+}
+
+int64_t FrameScheduler::Estimate(Stage stage) const {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return 0;
+  return EstimateLocked(stage);
+}
+
+int64_t FrameScheduler::NextStartTime(int64_t now_ns) const {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return now_ns;
+
+  if (!CanPredictLocked(now_ns))
+    return now_ns;
+
+  int64_t lead = LeadLocked();
+  int64_t target = PredictVblankLocked(now_ns + lead);
+  // A commit that's still in flight owns its vblank
+  if (pending_target_ns_)
+    target = std::max(target, pending_target_ns_ + PeriodLocked());
+
+  return std::max(now_ns, target - lead);
+}
+
+int64_t FrameScheduler::LeadLocked() const {
+  int64_t cost = EstimateLocked(kStagePrepare) + EstimateLocked(kStageCommit) +
+                 margin_ns_ + adaptive_margin_ns_;
+  return std::max(cost, -latch_phase_ns_);
+}
+
+bool FrameScheduler::TimeLeft(int64_t now_ns, int64_t *time_left_ns) const {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return false;
+
+  if (!CanPredictLocked(now_ns))
+    return false;
+
+  int64_t target = PredictVblankLocked(now_ns);
+  if (pending_target_ns_)
+    target = std::max(target, pending_target_ns_ + PeriodLocked());
+
+  *time_left_ns = target - now_ns - EstimateLocked(kStageCommit) - margin_ns_ -
+                  adaptive_margin_ns_;
+  return true;
+}
+
+void FrameScheduler::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "frame-scheduler");
+  if (lock.Lock())
+    return;
+
+  *out << "period_us=" << PeriodLocked() / 1000
+       << " prepare_us=" << EstimateLocked(kStagePrepare) / 1000
+       << " commit_us=" << EstimateLocked(kStageCommit) / 1000
+       << " squash_us=" << EstimateLocked(kStageSquash) / 1000
+       << " pre_comp_us=" << EstimateLocked(kStagePreComp) / 1000
+       << " margin_us=" << margin_ns_ / 1000
+       << " adaptive_margin_us=" << adaptive_margin_ns_ / 1000
+       << " latch_phase_us=" << latch_phase_ns_ / 1000
+       << " lead_us=" << LeadLocked() / 1000 << " flips=" << num_flips_
+       << " missed=" << num_missed_;
+}
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_FRAME_SCHEDULER_H_
+#define ANDROID_FRAME_SCHEDULER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sstream>
+
+namespace android {
+
+class VSyncModel;
+
+// Predicts upcoming vblanks from page flip timestamps and keeps track of how
+// long the compositor's pipeline stages take, so that work on a frame can be
+// started as late as possible while still making the next vblank it can.
+//
+// Starting late means the frame that gets picked up is the newest one
+// SurfaceFlinger has handed us, which is what cuts latency.
+class FrameScheduler {
+ public:
+  enum Stage {
+    kStagePrepare,  // precomposition, squashing and the test commit
+    kStageCommit,   // building and submitting the atomic request
+    kStageSquash,   // rendering the squash framebuffer, part of kStagePrepare
+    kStagePreComp,  // rendering the precomposition framebuffer, likewise
+    kNumStages,
+  };
+
+  FrameScheduler();
+  ~FrameScheduler();
+
+  int Init();
+
+  void SetRefreshRate(float refresh_hz);
+  void SetMargin(int64_t margin_ns);
+  // Work on a frame starts no later than |phase_ns| relative to the vblank
+  // it's for, negative meaning before. It starts earlier still when the
+  // measured stages need it.
+  void SetLatchPhase(int64_t phase_ns);
+  // Vblanks are predicted by |model| while it's locked, rather than from the
+  // last flip and the nominal refresh rate.
+  void SetVSyncModel(const VSyncModel *model);
+
+  // A non-blocking commit was submitted at |timestamp_ns|
+  void OnCommit(int64_t timestamp_ns);
+  // A commit hit the screen at |timestamp_ns|
+  void OnFlip(int64_t timestamp_ns);
+
+  void RecordStage(Stage stage, int64_t duration_ns);
+  // How long |stage| is expected to take, 0 until it has been recorded
+  int64_t Estimate(Stage stage) const;
+
+  // Returns when work on the next frame should start for it to make the
+  // earliest vblank it still can. That's |now_ns| if we're already late or
+  // there isn't enough history to predict vblanks.
+  int64_t NextStartTime(int64_t now_ns) const;
+
+  // Sets |time_left_ns| to how much time a frame that is being prepared at
+  // |now_ns| can still spend before it has to be committed to make the next
+  // vblank that isn't taken by an in-flight commit. The result is negative if
+  // that vblank is already out of reach. Returns false if vblanks can't be
+  // predicted.
+  bool TimeLeft(int64_t now_ns, int64_t *time_left_ns) const;
+
+  void Dump(std::ostringstream *out) const;
+
+  static int64_t Now();
+
+ private:
+  // Enough to cover a few frames of jitter without reacting to a single
+  // outlier for too long.
+  static const int kNumSamples = 32;
+
+  bool CanPredictLocked(int64_t now_ns) const;
+  int64_t PredictVblankLocked(int64_t after_ns) const;
+  int64_t PeriodLocked() const;
+  int64_t EstimateLocked(Stage stage) const;
+  // How long before its vblank work on a frame starts
+  int64_t LeadLocked() const;
+
+  const VSyncModel *vsync_model_;
+  int64_t period_ns_;
+  int64_t margin_ns_;
+  int64_t latch_phase_ns_;
+  // Added to margin_ns_ after missed vblanks, and worked off again while
+  // frames make it.
+  int64_t adaptive_margin_ns_;
+  int64_t last_vblank_ns_;
+  // The vblank an in-flight commit is expected to land on, 0 if none
+  int64_t pending_target_ns_;
+
+  int64_t samples_[kNumStages][kNumSamples];
+  int num_samples_[kNumStages];
+  int next_sample_[kNumStages];
+
+  uint64_t num_flips_;
+  uint64_t num_missed_;
+
+  bool initialized_;
+  mutable pthread_mutex_t lock_;
+};
+}
+
+#endif  // ANDROID_FRAME_SCHEDULER_H_
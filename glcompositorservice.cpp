@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-gl-compositor-service"
+
+#include "glcompositorservice.h"
+#include "autolock.h"
+#include "framescheduler.h"
+#include "glworker.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <tuple>
+
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <sync/sync.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+GLCompositorService::GLCompositorService()
+    : Worker("gl-compositor-service", HAL_PRIORITY_URGENT_DISPLAY),
+      context_wanted_(false),
+      context_ready_(false),
+      context_result_(0),
+      next_seq_(0),
+      num_jobs_(0),
+      num_missed_deadlines_(0),
+      jobs_initialized_(false) {
+}
+
+GLCompositorService::~GLCompositorService() {
+  if (!jobs_initialized_)
+    return;
+  Exit();
+  pthread_cond_destroy(&done_cond_);
+  pthread_mutex_destroy(&jobs_lock_);
+}
+
+int GLCompositorService::Init() {
+  int ret = pthread_mutex_init(&jobs_lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize GL service lock %d", ret);
+    return ret;
+  }
+  ret = pthread_cond_init(&done_cond_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize GL service condition %d", ret);
+    pthread_mutex_destroy(&jobs_lock_);
+    return ret;
+  }
+
+  ret = InitWorker();
+  if (ret) {
+    pthread_cond_destroy(&done_cond_);
+    pthread_mutex_destroy(&jobs_lock_);
+    return ret;
+  }
+  jobs_initialized_ = true;
+  return 0;
+}
+
+int GLCompositorService::WaitForContext() {
+  AutoLock lock(&jobs_lock_, "gl-service");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  if (!context_ready_) {
+    context_wanted_ = true;
+    lock.Unlock();
+    Signal();
+    ret = lock.Lock();
+    if (ret)
+      return ret;
+    while (!context_ready_)
+      pthread_cond_wait(&done_cond_, &jobs_lock_);
+  }
+  return context_result_;
+}
+
+bool GLCompositorService::HasWork() {
+  AutoLock lock(&jobs_lock_, "gl-service");
+  if (lock.Lock())
+    return false;
+  return !jobs_.empty() || (context_wanted_ && !context_ready_);
+}
+
+int GLCompositorService::Composite(DrmHwcLayer *layers,
+                                   DrmCompositionRegion *regions,
+                                   size_t num_regions,
+                                   const sp<GraphicBuffer> &framebuffer,
+                                   const DrmHwcRect<int> &fb_frame,
+                                   int priority, int64_t deadline_ns,
+                                   int *fence) {
+  ATRACE_CALL();
+  Job job;
+  job.layers = layers;
+  job.regions = regions;
+  job.num_regions = num_regions;
+  job.framebuffer = framebuffer;
+  job.fb_frame = fb_frame;
+  job.priority = priority;
+  job.deadline_ns = deadline_ns;
+
+  AutoLock lock(&jobs_lock_, "gl-service");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  if (!context_ready_ || context_result_)
+    return -ENODEV;
+
+  job.seq = next_seq_++;
+  jobs_.push_back(&job);
+  lock.Unlock();
+  Signal();
+
+  // The job is on our stack, so it can't be left behind to the service
+  while (lock.Lock())
+    sched_yield();
+  while (!job.done)
+    pthread_cond_wait(&done_cond_, &jobs_lock_);
+
+  *fence = job.fence;
+  return job.result;
+}
+
+GLCompositorService::Job *GLCompositorService::TakeNextJobLocked() {
+  if (jobs_.empty())
+    return NULL;
+
+  auto next = std::min_element(
+      jobs_.begin(), jobs_.end(), [](const Job *a, const Job *b) {
+        return std::tie(a->deadline_ns, a->priority, a->seq) <
+               std::tie(b->deadline_ns, b->priority, b->seq);
+      });
+  Job *job = *next;
+  jobs_.erase(next);
+  return job;
+}
+
+int GLCompositorService::RunJob(Job *job) {
+  ATRACE_CALL();
+  int ret = gl_->Composite(job->layers, job->regions, job->num_regions,
+                           job->framebuffer, job->fb_frame);
+  // Submitted even if it failed, as Finish() was before
+  job->fence = gl_->Flush();
+  return ret;
+}
+
+void GLCompositorService::Routine() {
+  int ret = Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+
+  int wait_ret = WaitForWorkOrExitLocked([this] { return HasWork(); });
+
+  ret = Unlock();
+  if (ret) {
+    ALOGE("Failed to unlock worker, %d", ret);
+    return;
+  }
+
+  if (wait_ret == -EINTR) {
+    return;
+  } else if (wait_ret) {
+    ALOGE("Failed to wait for signal, %d", wait_ret);
+    return;
+  }
+
+  AutoLock lock(&jobs_lock_, "gl-service");
+  if (lock.Lock())
+    return;
+
+  // The context is made current on this thread, so it has to be created here
+  if (context_wanted_ && !context_ready_) {
+    lock.Unlock();
+    std::unique_ptr<GLWorkerCompositor> gl(new GLWorkerCompositor());
+    int result = gl->Init();
+    if (result)
+      ALOGE("Failed to initialize shared GL compositor %d", result);
+    if (lock.Lock())
+      return;
+    if (!result)
+      gl_ = std::move(gl);
+    context_result_ = result;
+    context_ready_ = true;
+    pthread_cond_broadcast(&done_cond_);
+  }
+
+  Job *job = TakeNextJobLocked();
+  if (!job)
+    return;
+  lock.Unlock();
+
+  int result = RunJob(job);
+  int64_t now = FrameScheduler::Now();
+
+  // The submitter waits for |job| on its stack, it has to be completed
+  while (lock.Lock())
+    sched_yield();
+  num_jobs_++;
+  if (now > job->deadline_ns)
+    num_missed_deadlines_++;
+  job->result = result;
+  job->done = true;
+  pthread_cond_broadcast(&done_cond_);
+}
+
+void GLCompositorService::Exiting() {
+  // The context is current on this thread, so it is torn down here too
+  gl_.reset();
+  AutoLock lock(&jobs_lock_, "gl-service");
+  if (lock.Lock())
+    return;
+  context_result_ = -ENODEV;
+}
+
+void GLCompositorService::Dump(std::ostringstream *out) const {
+  AutoLock lock(&jobs_lock_, "gl-service");
+  if (lock.Lock())
+    return;
+
+  *out << "  Shared GL compositor: ready=" << context_ready_
+       << " result=" << context_result_ << " jobs=" << num_jobs_
+       << " missed_deadlines=" << num_missed_deadlines_
+       << " queued=" << jobs_.size() << "\n";
+}
+
+SharedGLCompositor::SharedGLCompositor(GLCompositorService *service,
+                                       int priority,
+                                       const FrameScheduler *scheduler)
+    : service_(service), priority_(priority), scheduler_(scheduler),
+      fence_(-1) {
+}
+
+SharedGLCompositor::~SharedGLCompositor() {
+  Finish();
+}
+
+int SharedGLCompositor::Init() {
+  return service_->WaitForContext();
+}
+
+int SharedGLCompositor::Composite(DrmHwcLayer *layers,
+                                  DrmCompositionRegion *regions,
+                                  size_t num_regions,
+                                  const sp<GraphicBuffer> &framebuffer,
+                                  const DrmHwcRect<int> &fb_frame) {
+  // The previous job is done with by now, Finish() or Flush() come first
+  if (fence_ >= 0) {
+    close(fence_);
+    fence_ = -1;
+  }
+
+  int64_t deadline_ns = INT64_MAX;
+  int64_t now = FrameScheduler::Now();
+  int64_t time_left_ns;
+  if (scheduler_ && scheduler_->TimeLeft(now, &time_left_ns))
+    deadline_ns = now + time_left_ns;
+
+  return service_->Composite(layers, regions, num_regions, framebuffer,
+                             fb_frame, priority_, deadline_ns, &fence_);
+}
+
+void SharedGLCompositor::Finish() {
+  if (fence_ < 0)
+    return;
+
+  ATRACE_CALL();
+  int ret = sync_wait(fence_, -1);
+  if (ret)
+    ALOGE("Failed to wait for shared GL job %d", ret);
+  close(fence_);
+  fence_ = -1;
+}
+
+int SharedGLCompositor::Flush() {
+  int fence = fence_;
+  fence_ = -1;
+  return fence;
+}
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_GL_COMPOSITOR_SERVICE_H_
+#define ANDROID_GL_COMPOSITOR_SERVICE_H_
+
+#include "precompositor.h"
+#include "worker.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace android {
+
+class FrameScheduler;
+class GLWorkerCompositor;
+
+// One thread that does the GL precomposition for all displays, with a single
+// EGL context and a single set of program and framebuffer caches. Displays
+// hand it jobs through SharedGLCompositor. The job with the earliest vblank
+// deadline goes first, ties go to the display with the higher priority, i.e.
+// the lower number.
+class GLCompositorService : public Worker {
+ public:
+  // For work that has no deadline, such as squashing an idle display
+  static const int kIdlePriority = 1 << 16;
+
+  GLCompositorService();
+  ~GLCompositorService() override;
+
+  int Init();
+
+  // Blocks until the GL context is set up, returns whether that worked
+  int WaitForContext();
+
+  // Renders the regions into |framebuffer| and submits the rendering. Blocks
+  // until that is done. Sets |fence| to a fence for the completion of the
+  // rendering, or -1 if it has completed already.
+  int Composite(DrmHwcLayer *layers, DrmCompositionRegion *regions,
+                size_t num_regions, const sp<GraphicBuffer> &framebuffer,
+                const DrmHwcRect<int> &fb_frame, int priority,
+                int64_t deadline_ns, int *fence);
+
+  void Dump(std::ostringstream *out) const;
+
+ protected:
+  void Routine() override;
+  void Exiting() override;
+
+ private:
+  struct Job {
+    DrmHwcLayer *layers;
+    DrmCompositionRegion *regions;
+    size_t num_regions;
+    sp<GraphicBuffer> framebuffer;
+    DrmHwcRect<int> fb_frame;
+    int priority;
+    int64_t deadline_ns;
+    uint64_t seq;
+
+    bool done = false;
+    int result = 0;
+    int fence = -1;
+  };
+
+  bool HasWork();
+  // Must be called with jobs_lock_ held
+  Job *TakeNextJobLocked();
+  int RunJob(Job *job);
+
+  // Only touched by the service thread once context_ready_ is set
+  std::unique_ptr<GLWorkerCompositor> gl_;
+  bool context_wanted_;
+  bool context_ready_;
+  int context_result_;
+
+  std::vector<Job *> jobs_;
+  uint64_t next_seq_;
+
+  uint64_t num_jobs_;
+  uint64_t num_missed_deadlines_;
+
+  bool jobs_initialized_;
+  mutable pthread_mutex_t jobs_lock_;
+  pthread_cond_t done_cond_;
+};
+
+// Each display's handle on the GLCompositorService
+class SharedGLCompositor : public PreCompositor {
+ public:
+  // |scheduler| provides the deadlines of the display's jobs, NULL for jobs
+  // without one.
+  SharedGLCompositor(GLCompositorService *service, int priority,
+                     const FrameScheduler *scheduler);
+  ~SharedGLCompositor() override;
+
+  int Init() override;
+  int Composite(DrmHwcLayer *layers, DrmCompositionRegion *regions,
+                size_t num_regions, const sp<GraphicBuffer> &framebuffer,
+                const DrmHwcRect<int> &fb_frame) override;
+  void Finish() override;
+  int Flush() override;
+
+  const char *name() const override {
+    return "gl-shared";
+  }
+
+ private:
+  GLCompositorService *service_;
+  int priority_;
+  const FrameScheduler *scheduler_;
+
+  // Completion of the last job
+  int fence_;
+};
+}
+
+#endif  // ANDROID_GL_COMPOSITOR_SERVICE_H_
@@ -17,6 +17,7 @@
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #define LOG_TAG "hwc-gl-worker"
 
+#include <math.h>
 #include <algorithm>
 #include <string>
 #include <sstream>
@@ -25,6 +26,7 @@
 #include <sys/resource.h>
 
 #include <cutils/properties.h>
+#include <drm/drm_fourcc.h>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
@@ -43,21 +45,8 @@
 #define EGL_NATIVE_HANDLE_ANDROID_NVX 0x322A
 #endif
 
-#define MAX_OVERLAPPING_LAYERS 64
-
 namespace android {
 
-// clang-format off
-// Column-major order:
-// float mat[4] = { 1, 2, 3, 4 } ===
-// [ 1 3 ]
-// [ 2 4 ]
-float kTextureTransformMatrices[] = {
-   1.0f,  0.0f,  0.0f,  1.0f, // identity matrix
-   0.0f,  1.0f,  1.0f,  0.0f, // swap x and y
-};
-// clang-format on
-
 static const char *GetGLError(void) {
   switch (glGetError()) {
     case GL_NO_ERROR:
@@ -292,102 +281,48 @@ static AutoGLProgram GenerateProgram(unsigned num_textures,
   return program;
 }
 
-struct RenderingCommand {
-  struct TextureSource {
-    unsigned texture_index;
-    float crop_bounds[4];
-    float alpha;
-    float premult;
-    float texture_matrix[4];
-  };
-
-  float bounds[4];
-  unsigned texture_count = 0;
-  TextureSource textures[MAX_OVERLAPPING_LAYERS];
-};
-
-static void ConstructCommand(const DrmHwcLayer *layers,
-                             const DrmCompositionRegion &region,
-                             RenderingCommand &cmd) {
-  std::copy_n(region.frame.bounds, 4, cmd.bounds);
-
-  for (size_t texture_index : region.source_layers) {
-    const DrmHwcLayer &layer = layers[texture_index];
-
-    DrmHwcRect<float> display_rect(layer.display_frame);
-    float display_size[2] = {display_rect.bounds[2] - display_rect.bounds[0],
-                             display_rect.bounds[3] - display_rect.bounds[1]};
-
-    float tex_width = layer.buffer->width;
-    float tex_height = layer.buffer->height;
-    DrmHwcRect<float> crop_rect(layer.source_crop.left / tex_width,
-                                layer.source_crop.top / tex_height,
-                                layer.source_crop.right / tex_width,
-                                layer.source_crop.bottom / tex_height);
-
-    float crop_size[2] = {crop_rect.bounds[2] - crop_rect.bounds[0],
-                          crop_rect.bounds[3] - crop_rect.bounds[1]};
-
-    RenderingCommand::TextureSource &src = cmd.textures[cmd.texture_count];
-    cmd.texture_count++;
-    src.texture_index = texture_index;
-
-    bool swap_xy = false;
-    bool flip_xy[2] = { false, false };
-
-    if (layer.transform == DrmHwcTransform::kRotate180) {
-      swap_xy = false;
-      flip_xy[0] = true;
-      flip_xy[1] = true;
-    } else if (layer.transform == DrmHwcTransform::kRotate270) {
-      swap_xy = true;
-      flip_xy[0] = true;
-      flip_xy[1] = false;
-    } else if (layer.transform & DrmHwcTransform::kRotate90) {
-      swap_xy = true;
-      if (layer.transform & DrmHwcTransform::kFlipH) {
-        flip_xy[0] = true;
-        flip_xy[1] = true;
-      } else if (layer.transform & DrmHwcTransform::kFlipV) {
-        flip_xy[0] = false;
-        flip_xy[1] = false;
-      } else {
-        flip_xy[0] = false;
-        flip_xy[1] = true;
-      }
-    } else {
-      if (layer.transform & DrmHwcTransform::kFlipH)
-        flip_xy[0] = true;
-      if (layer.transform & DrmHwcTransform::kFlipV)
-        flip_xy[1] = true;
-    }
-
-    if (swap_xy)
-      std::copy_n(&kTextureTransformMatrices[4], 4, src.texture_matrix);
-    else
-      std::copy_n(&kTextureTransformMatrices[0], 4, src.texture_matrix);
-
-    for (int j = 0; j < 4; j++) {
-      int b = j ^ (swap_xy ? 1 : 0);
-      float bound_percent =
-          (cmd.bounds[b] - display_rect.bounds[b % 2]) / display_size[b % 2];
-      if (flip_xy[j % 2]) {
-        src.crop_bounds[j] =
-            crop_rect.bounds[j % 2 + 2] - bound_percent * crop_size[j % 2];
-      } else {
-        src.crop_bounds[j] =
-            crop_rect.bounds[j % 2] + bound_percent * crop_size[j % 2];
-      }
-    }
+static bool IsRgbFormat(uint32_t format) {
+  switch (format) {
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_BGR888:
+    case DRM_FORMAT_BGR565:
+      return true;
+    default:
+      return false;
+  }
+}
 
-    if (layer.blending == DrmHwcBlending::kNone) {
-      src.alpha = src.premult = 1.0f;
-      // This layer is opaque. There is no point in using layers below this one.
-      break;
-    }
+static bool IsOpaqueFormat(uint32_t format) {
+  return format != DRM_FORMAT_ABGR8888 && format != DRM_FORMAT_ARGB8888;
+}
 
-    src.alpha = layer.alpha / 255.0f;
-    src.premult = (layer.blending == DrmHwcBlending::kPreMult) ? 1.0f : 0.0f;
+// Returns true if the command can be rendered with a straight copy of its
+// source. With a cleared target and a single source, the shader writes the
+// source texel unmodified unless a transform, plane alpha or coverage
+// multiply is involved.
+static bool IsBlittable(const DrmHwcLayer *layers,
+                        const RenderingCommand &cmd) {
+  if (cmd.texture_count != 1)
+    return false;
+
+  const DrmHwcLayer &layer = layers[cmd.textures[0].texture_index];
+  if (layer.transform != DrmHwcTransform::kIdentity)
+    return false;
+  if (!IsRgbFormat(layer.buffer->format))
+    return false;
+
+  switch (layer.blending) {
+    case DrmHwcBlending::kNone:
+      return true;
+    case DrmHwcBlending::kPreMult:
+      return layer.alpha == 0xff;
+    case DrmHwcBlending::kCoverage:
+      return layer.alpha == 0xff && IsOpaqueFormat(layer.buffer->format);
+    default:
+      return false;
   }
 }
 
@@ -443,7 +378,7 @@ static int CreateTextureFromHandle(EGLDisplay egl_display,
 }
 
 GLWorkerCompositor::GLWorkerCompositor()
-    : egl_display_(EGL_NO_DISPLAY), egl_ctx_(EGL_NO_CONTEXT) {
+    : egl_display_(EGL_NO_DISPLAY), egl_ctx_(EGL_NO_CONTEXT), use_blit_(false) {
 }
 
 int GLWorkerCompositor::Init() {
@@ -540,6 +475,15 @@ int GLWorkerCompositor::Init() {
     return 1;
   }
 
+  char use_blit_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.use_gl_blit", use_blit_opt, "1");
+  use_blit_ = atoi(use_blit_opt);
+  if (use_blit_) {
+    GLuint blit_read_fb;
+    glGenFramebuffers(1, &blit_read_fb);
+    blit_read_fb_.reset(blit_read_fb);
+  }
+
   return 0;
 }
 
@@ -552,7 +496,8 @@ GLWorkerCompositor::~GLWorkerCompositor() {
 int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
                                   DrmCompositionRegion *regions,
                                   size_t num_regions,
-                                  const sp<GraphicBuffer> &framebuffer) {
+                                  const sp<GraphicBuffer> &framebuffer,
+                                  const DrmHwcRect<int> &fb_frame) {
   ATRACE_CALL();
   int ret = 0;
   std::vector<AutoEGLImageAndGLTexture> layer_textures;
@@ -572,14 +517,25 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
   }
 
   std::unordered_set<size_t> layers_used_indices;
+  std::unordered_set<size_t> blit_layer_indices;
+  std::vector<bool> blit_commands;
   for (size_t region_index = 0; region_index < num_regions; region_index++) {
     DrmCompositionRegion &region = regions[region_index];
     layers_used_indices.insert(region.source_layers.begin(),
                                region.source_layers.end());
     commands.emplace_back();
-    ConstructCommand(layers, region, commands.back());
+    ConstructCommand(layers, region, fb_frame, commands.back());
+
+    bool blit = use_blit_ && IsBlittable(layers, commands.back());
+    blit_commands.push_back(blit);
+    if (blit)
+      blit_layer_indices.insert(commands.back().textures[0].texture_index);
   }
 
+  // Blit sources need a GL_TEXTURE_2D that can be attached to a framebuffer,
+  // the external textures used by the shaders can't be.
+  std::vector<AutoGLTexture> blit_textures(MAX_OVERLAPPING_LAYERS);
+
   for (size_t layer_index = 0; layer_index < MAX_OVERLAPPING_LAYERS;
        layer_index++) {
     DrmHwcLayer *layer = &layers[layer_index];
@@ -598,6 +554,17 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
     if (ret) {
       layer_textures.pop_back();
       ret = -EINVAL;
+      continue;
+    }
+
+    if (blit_layer_indices.count(layer_index)) {
+      GLuint texture;
+      glGenTextures(1, &texture);
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glEGLImageTargetTexture2DOES(
+          GL_TEXTURE_2D, (GLeglImageOES)layer_textures.back().image.image());
+      glBindTexture(GL_TEXTURE_2D, 0);
+      blit_textures[layer_index].reset(texture);
     }
   }
 
@@ -609,6 +576,23 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
   glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
   glClear(GL_COLOR_BUFFER_BIT);
 
+  // Regions don't overlap, so the copies can all go ahead of the shader pass.
+  // This must happen before the scissor test is enabled as it applies to
+  // blits as well.
+  if (!blit_layer_indices.empty()) {
+    for (size_t i = 0; i < commands.size(); i++) {
+      if (!blit_commands[i])
+        continue;
+      size_t layer_index = commands[i].textures[0].texture_index;
+      if (BlitRegion(layers[layer_index], commands[i],
+                     blit_textures[layer_index].get()))
+        blit_commands[i] = false;
+    }
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, 0, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, cached_framebuffer->gl_fb.get());
+  }
+
   glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_.get());
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, NULL);
   glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4,
@@ -617,8 +601,9 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
   glEnableVertexAttribArray(1);
   glEnable(GL_SCISSOR_TEST);
 
-  for (const RenderingCommand &cmd : commands) {
-    if (cmd.texture_count == 0)
+  for (size_t i = 0; i < commands.size(); i++) {
+    const RenderingCommand &cmd = commands[i];
+    if (cmd.texture_count == 0 || blit_commands[i])
       continue;
 
     // TODO(zachr): handle the case of too many overlapping textures for one
@@ -683,10 +668,67 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
   return ret;
 }
 
+int GLWorkerCompositor::BlitRegion(const DrmHwcLayer &layer,
+                                   const RenderingCommand &cmd,
+                                   GLuint texture) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, blit_read_fb_.get());
+  glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                         GL_TEXTURE_2D, texture, 0);
+  if (glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) !=
+      GL_FRAMEBUFFER_COMPLETE) {
+    ALOGW("Blit source is not readable, falling back to shader composite");
+    return -EINVAL;
+  }
+
+  const RenderingCommand::TextureSource &src = cmd.textures[0];
+  float tex_width = layer.buffer->width;
+  float tex_height = layer.buffer->height;
+  GLint src_rect[4] = {(GLint)lroundf(src.crop_bounds[0] * tex_width),
+                       (GLint)lroundf(src.crop_bounds[1] * tex_height),
+                       (GLint)lroundf(src.crop_bounds[2] * tex_width),
+                       (GLint)lroundf(src.crop_bounds[3] * tex_height)};
+  GLint dst_rect[4] = {(GLint)cmd.bounds[0], (GLint)cmd.bounds[1],
+                       (GLint)cmd.bounds[2], (GLint)cmd.bounds[3]};
+  bool scaled = src_rect[2] - src_rect[0] != dst_rect[2] - dst_rect[0] ||
+                src_rect[3] - src_rect[1] != dst_rect[3] - dst_rect[1];
+
+  glBlitFramebuffer(src_rect[0], src_rect[1], src_rect[2], src_rect[3],
+                    dst_rect[0], dst_rect[1], dst_rect[2], dst_rect[3],
+                    GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+  return 0;
+}
+
 void GLWorkerCompositor::Finish() {
   ATRACE_CALL();
   glFinish();
+  ReleaseFramebuffers();
+}
+
+int GLWorkerCompositor::Flush() {
+  ATRACE_CALL();
+  EGLSyncKHR egl_sync =
+      eglCreateSyncKHR(egl_display_, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+  if (egl_sync == EGL_NO_SYNC_KHR) {
+    ALOGW("Failed to make native fence sync: %s", GetEGLError());
+    Finish();
+    return -1;
+  }
+
+  // The fence only gets an fd once the commands before it are submitted
+  glFlush();
+  int fence = eglDupNativeFenceFDANDROID(egl_display_, egl_sync);
+  eglDestroySyncKHR(egl_display_, egl_sync);
+  if (fence < 0) {
+    ALOGW("Failed to get native fence fd: %s", GetEGLError());
+    Finish();
+    return -1;
+  }
+
+  ReleaseFramebuffers();
+  return fence;
+}
 
+void GLWorkerCompositor::ReleaseFramebuffers() {
   char use_framebuffer_cache_opt[PROPERTY_VALUE_MAX];
   property_get("hwc.drm.use_framebuffer_cache", use_framebuffer_cache_opt, "1");
   bool use_framebuffer_cache = atoi(use_framebuffer_cache_opt);
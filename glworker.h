@@ -26,25 +26,33 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
+#include <GLES3/gl3.h>
 
 #include <ui/GraphicBuffer.h>
 
 #include "autogl.h"
+#include "precompositor.h"
 
 namespace android {
 
 struct DrmHwcLayer;
 struct DrmCompositionRegion;
 
-class GLWorkerCompositor {
+class GLWorkerCompositor : public PreCompositor {
  public:
   GLWorkerCompositor();
-  ~GLWorkerCompositor();
+  ~GLWorkerCompositor() override;
 
-  int Init();
+  int Init() override;
   int Composite(DrmHwcLayer *layers, DrmCompositionRegion *regions,
-                size_t num_regions, const sp<GraphicBuffer> &framebuffer);
-  void Finish();
+                size_t num_regions, const sp<GraphicBuffer> &framebuffer,
+                const DrmHwcRect<int> &fb_frame) override;
+  void Finish() override;
+  int Flush() override;
+
+  const char *name() const override {
+    return "gl";
+  }
 
  private:
   struct CachedFramebuffer {
@@ -68,7 +76,12 @@ class GLWorkerCompositor {
   CachedFramebuffer *PrepareAndCacheFramebuffer(
       const sp<GraphicBuffer> &framebuffer);
 
+  // Drops the references held on framebuffers for rendering in flight
+  void ReleaseFramebuffers();
+
   GLint PrepareAndCacheProgram(unsigned texture_count);
+  int BlitRegion(const DrmHwcLayer &layer, const RenderingCommand &cmd,
+                 GLuint texture);
 
   EGLDisplay egl_display_;
   EGLContext egl_ctx_;
@@ -76,6 +89,11 @@ class GLWorkerCompositor {
   std::vector<AutoGLProgram> blend_programs_;
   AutoGLBuffer vertex_buffer_;
 
+  // Read framebuffer that single source regions are blitted from. The source
+  // texture is swapped in for each blit.
+  AutoGLFramebuffer blit_read_fb_;
+  bool use_blit_;
+
   std::vector<CachedFramebuffer> cached_framebuffers_;
 };
 }
@@ -148,6 +148,9 @@ class DrmHotplugHandler : public DrmEventHandler {
             cur_state == DRM_MODE_CONNECTED ? "Plug" : "Unplug", timestamp_us,
             conn->id());
 
+      // The kernel may have reset the display pipe along with the connector
+      drm_->property_shadow()->Invalidate();
+
       if (cur_state == DRM_MODE_CONNECTED) {
         // Take the first one, then look for the preferred
         DrmMode mode = *(conn->modes().begin());
@@ -186,15 +189,12 @@ struct hwc_context_t {
   // map of display:hwc_drm_display_t
   typedef std::map<int, hwc_drm_display_t> DisplayMap;
 
-  ~hwc_context_t() {
-    virtual_compositor_worker.Exit();
-  }
-
   hwc_composer_device_1_t device;
   hwc_procs_t const *procs = NULL;
 
-  DisplayMap displays;
   DrmResources drm;
+  // After drm, the vsync workers run on its event loop
+  DisplayMap displays;
   std::unique_ptr<Importer> importer;
   const gralloc_module_t *gralloc;
   DummySwSyncTimeline dummy_timeline;
@@ -369,6 +369,10 @@ static void hwc_dump(struct hwc_composer_device_1 *dev, char *buff,
   std::ostringstream out;
 
   ctx->drm.compositor()->Dump(&out);
+  ctx->virtual_compositor_worker.Dump(&out);
+  for (auto &display_entry : ctx->displays)
+    display_entry.second.vsync_worker.Dump(&out);
+  Worker::DumpAll(&out);
   std::string out_str = out.str();
   strncpy(buff, out_str.c_str(),
           std::min((size_t)buff_len, out_str.length() + 1));
@@ -660,15 +664,33 @@ static int hwc_set_power_mode(struct hwc_composer_device_1 *dev, int display,
   return ctx->drm.SetDpmsMode(display, dpmsValue);
 }
 
-static int hwc_query(struct hwc_composer_device_1 * /* dev */, int what,
-                     int *value) {
+// The measured period while the display's vsync model is locked, the mode's
+// nominal one otherwise.
+static int64_t hwc_get_vsync_period(struct hwc_context_t *ctx, int display,
+                                    const DrmMode &mode) {
+  DrmConnector *c = ctx->drm.GetConnectorForDisplay(display);
+  VSyncModel *model = ctx->drm.compositor()->GetVSyncModel(display);
+  if (c && model && model->locked() && c->active_mode().id() == mode.id())
+    return model->period_ns();
+
+  int64_t period_ns = mode.frame_period_ns();
+  return period_ns > 0 ? period_ns : 1000 * 1000 * 1000 / 60;
+}
+
+static int hwc_query(struct hwc_composer_device_1 *dev, int what, int *value) {
+  struct hwc_context_t *ctx = (struct hwc_context_t *)&dev->common;
+  DrmConnector *c;
   switch (what) {
     case HWC_BACKGROUND_LAYER_SUPPORTED:
       *value = 0; /* TODO: We should do this */
       break;
     case HWC_VSYNC_PERIOD:
-      ALOGW("Query for deprecated vsync value, returning 60Hz");
-      *value = 1000 * 1000 * 1000 / 60;
+      c = ctx->drm.GetConnectorForDisplay(HWC_DISPLAY_PRIMARY);
+      if (c)
+        *value = hwc_get_vsync_period(ctx, HWC_DISPLAY_PRIMARY,
+                                      c->active_mode());
+      else
+        *value = 1000 * 1000 * 1000 / 60;
       break;
     case HWC_DISPLAY_TYPES_SUPPORTED:
       *value = HWC_DISPLAY_PRIMARY_BIT | HWC_DISPLAY_EXTERNAL_BIT |
@@ -751,7 +773,7 @@ static int hwc_get_display_attributes(struct hwc_composer_device_1 *dev,
   for (int i = 0; attributes[i] != HWC_DISPLAY_NO_ATTRIBUTE; ++i) {
     switch (attributes[i]) {
       case HWC_DISPLAY_VSYNC_PERIOD:
-        values[i] = 1000 * 1000 * 1000 / mode.v_refresh();
+        values[i] = hwc_get_vsync_period(ctx, display, mode);
         break;
       case HWC_DISPLAY_WIDTH:
         values[i] = mode.h_display();
@@ -891,7 +913,7 @@ static int hwc_enumerate_displays(struct hwc_context_t *ctx) {
     }
   }
 
-  ret = ctx->virtual_compositor_worker.Init();
+  ret = ctx->virtual_compositor_worker.Init(ctx->drm.event_listener());
   if (ret) {
     ALOGE("Failed to initialize virtual compositor worker");
     return ret;
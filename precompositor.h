@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_PRE_COMPOSITOR_H_
+#define ANDROID_PRE_COMPOSITOR_H_
+
+#include <stdint.h>
+
+#include <ui/GraphicBuffer.h>
+
+#include "drmhwcomposer.h"
+
+#define MAX_OVERLAPPING_LAYERS 64
+
+namespace android {
+
+struct DrmCompositionRegion;
+
+// Describes how to blend the sources of one region, front to back. The bounds
+// are in framebuffer coordinates, and the crop bounds are normalized texture
+// coordinates of the region's corners in the source buffer, with any flips
+// already folded in.
+struct RenderingCommand {
+  struct TextureSource {
+    unsigned texture_index;
+    float crop_bounds[4];
+    float alpha;
+    float premult;
+    float texture_matrix[4];
+  };
+
+  float bounds[4];
+  unsigned texture_count = 0;
+  TextureSource textures[MAX_OVERLAPPING_LAYERS];
+};
+
+// |fb_frame| is the area of the display covered by the framebuffer being
+// rendered, its top left corner becomes the framebuffer origin.
+void ConstructCommand(const DrmHwcLayer *layers,
+                      const DrmCompositionRegion &region,
+                      const DrmHwcRect<int> &fb_frame, RenderingCommand &cmd);
+
+// A backend that renders composition regions into a framebuffer which is then
+// scanned out on a single plane.
+class PreCompositor {
+ public:
+  virtual ~PreCompositor() {
+  }
+
+  virtual int Init() = 0;
+  virtual int Composite(DrmHwcLayer *layers, DrmCompositionRegion *regions,
+                        size_t num_regions,
+                        const sp<GraphicBuffer> &framebuffer,
+                        const DrmHwcRect<int> &fb_frame) = 0;
+  virtual void Finish() = 0;
+  // Submits what Composite() rendered without waiting for it. Returns a fence
+  // that signals once the rendering is done, or -1 if it is done already.
+  virtual int Flush() {
+    Finish();
+    return -1;
+  }
+
+  // Extra gralloc usage bits this backend needs on the framebuffers it
+  // renders into.
+  virtual uint32_t framebuffer_usage() const {
+    return 0;
+  }
+
+  virtual const char *name() const = 0;
+};
+}
+
+#endif  // ANDROID_PRE_COMPOSITOR_H_
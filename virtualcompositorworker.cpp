@@ -17,31 +17,31 @@
 #define LOG_TAG "hwc-virtual-compositor-worker"
 
 #include "virtualcompositorworker.h"
-#include "worker.h"
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
-#include <sched.h>
 #include <sw_sync.h>
-#include <sync/sync.h>
 
 namespace android {
 
 static const int kMaxQueueDepth = 3;
+static const int64_t kQueueTimeoutNs = 1000LL * 1000 * 1000;
 static const int kAcquireWaitTimeoutMs = 3000;
 
 VirtualCompositorWorker::VirtualCompositorWorker()
-    : Worker("virtual-compositor", HAL_PRIORITY_URGENT_DISPLAY),
-      timeline_fd_(-1),
+    : timeline_fd_(-1),
       timeline_(0),
       timeline_current_(0) {
 }
 
 VirtualCompositorWorker::~VirtualCompositorWorker() {
+  executor_.Exit();
   if (timeline_fd_ >= 0) {
     FinishComposition(timeline_);
     close(timeline_fd_);
@@ -49,14 +49,27 @@ VirtualCompositorWorker::~VirtualCompositorWorker() {
   }
 }
 
-int VirtualCompositorWorker::Init() {
+int VirtualCompositorWorker::Init(DrmEventListener *loop) {
   int ret = sw_sync_timeline_create();
   if (ret < 0) {
     ALOGE("Failed to create sw sync timeline %d", ret);
     return ret;
   }
   timeline_fd_ = ret;
-  return InitWorker();
+
+  char key[PROPERTY_KEY_MAX];
+  char value[PROPERTY_VALUE_MAX];
+  snprintf(key, sizeof(key), "hwc.drm.display%d.queue_depth",
+           HWC_DISPLAY_VIRTUAL);
+  property_get(key, value, "");
+  int queue_depth = atoi(value);
+  ret = composite_queue_.Init(queue_depth > 0 ? queue_depth : kMaxQueueDepth);
+  if (ret) {
+    ALOGE("Failed to initialize composite queue %d", ret);
+    return ret;
+  }
+
+  return executor_.Init(loop);
 }
 
 void VirtualCompositorWorker::QueueComposite(hwc_display_contents_1_t *dc) {
@@ -81,50 +94,26 @@ void VirtualCompositorWorker::QueueComposite(hwc_display_contents_1_t *dc) {
 
   composition->release_timeline = timeline_;
 
-  Lock();
-  while (composite_queue_.size() >= kMaxQueueDepth) {
-    Unlock();
-    sched_yield();
-    Lock();
-  }
-
-  composite_queue_.push(std::move(composition));
-  SignalLocked();
-  Unlock();
-}
-
-void VirtualCompositorWorker::Routine() {
-  int ret = Lock();
-  if (ret) {
-    ALOGE("Failed to lock worker, %d", ret);
-    return;
-  }
-
-  int wait_ret = 0;
-  if (composite_queue_.empty()) {
-    wait_ret = WaitForSignalOrExitLocked();
-  }
-
-  std::unique_ptr<VirtualComposition> composition;
-  if (!composite_queue_.empty()) {
-    composition = std::move(composite_queue_.front());
-    composite_queue_.pop();
-  }
-
-  ret = Unlock();
+  // If the queue stays full the composition is dropped. Its fences are still
+  // signaled once the next composition finishes, since that advances the
+  // timeline past them.
+  int ret = composite_queue_.Push(std::move(composition), kQueueTimeoutNs);
   if (ret) {
-    ALOGE("Failed to unlock worker, %d", ret);
+    ALOGE("Failed to queue virtual composition %d", ret);
     return;
   }
 
-  if (wait_ret == -EINTR) {
-    return;
-  } else if (wait_ret) {
-    ALOGE("Failed to wait for signal, %d", wait_ret);
-    return;
-  }
+  ret = executor_.Post([this]() { ComposeNext(); });
+  if (ret)
+    ALOGE("Failed to post virtual composition %d", ret);
+}
 
-  Compose(std::move(composition));
+void VirtualCompositorWorker::Dump(std::ostringstream *out) const {
+  *out << "--VirtualCompositorWorker: queue ";
+  composite_queue_.Dump(out);
+  *out << " executor ";
+  executor_.Dump(out);
+  *out << "\n";
 }
 
 int VirtualCompositorWorker::CreateNextTimelineFence() {
@@ -144,34 +133,54 @@ int VirtualCompositorWorker::FinishComposition(int point) {
   return ret;
 }
 
-void VirtualCompositorWorker::Compose(
-    std::unique_ptr<VirtualComposition> composition) {
-  if (!composition.get())
+void VirtualCompositorWorker::ComposeNext() {
+  if (composition_)
     return;
+  if (!composite_queue_.Pop(&composition_))
+    return;
+  WaitForAcquireFences();
+}
 
-  int ret;
-  int outbuf_acquire_fence = composition->outbuf_acquire_fence.get();
-  if (outbuf_acquire_fence >= 0) {
-    ret = sync_wait(outbuf_acquire_fence, kAcquireWaitTimeoutMs);
-    if (ret) {
-      ALOGE("Failed to wait for outbuf acquire %d/%d", outbuf_acquire_fence,
-            ret);
-      return;
-    }
-    composition->outbuf_acquire_fence.Close();
-  }
-  for (size_t i = 0; i < composition->layer_acquire_fences.size(); ++i) {
-    int layer_acquire_fence = composition->layer_acquire_fences[i].get();
-    if (layer_acquire_fence >= 0) {
-      ret = sync_wait(layer_acquire_fence, kAcquireWaitTimeoutMs);
-      if (ret) {
-        ALOGE("Failed to wait for layer acquire %d/%d", layer_acquire_fence,
-              ret);
-        return;
+// Waits for one fence at a time, in the order the thread used to
+void VirtualCompositorWorker::WaitForAcquireFences() {
+  UniqueFd *fence = NULL;
+  const char *what = NULL;
+  if (composition_->outbuf_acquire_fence.get() >= 0) {
+    fence = &composition_->outbuf_acquire_fence;
+    what = "outbuf";
+  } else {
+    for (UniqueFd &layer_fence : composition_->layer_acquire_fences) {
+      if (layer_fence.get() >= 0) {
+        fence = &layer_fence;
+        what = "layer";
+        break;
       }
-      composition->layer_acquire_fences[i].Close();
     }
   }
-  FinishComposition(composition->release_timeline);
+
+  if (!fence) {
+    FinishComposition(composition_->release_timeline);
+    composition_.reset();
+    ComposeNext();
+    return;
+  }
+
+  int fd = fence->get();
+  int ret = executor_.PostWhenReadable(
+      fd, kAcquireWaitTimeoutMs, [this, fence, fd, what](int result) {
+        if (result) {
+          ALOGE("Failed to wait for %s acquire %d/%d", what, fd, result);
+          composition_.reset();
+          ComposeNext();
+          return;
+        }
+        fence->Close();
+        WaitForAcquireFences();
+      });
+  if (ret) {
+    ALOGE("Failed to wait for %s acquire %d/%d", what, fd, ret);
+    composition_.reset();
+    ComposeNext();
+  }
 }
 }
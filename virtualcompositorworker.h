@@ -17,23 +17,26 @@
 #ifndef ANDROID_VIRTUAL_COMPOSITOR_WORKER_H_
 #define ANDROID_VIRTUAL_COMPOSITOR_WORKER_H_
 
+#include "boundedqueue.h"
 #include "drmhwcomposer.h"
-#include "worker.h"
+#include "executor.h"
 
-#include <queue>
+#include <memory>
+#include <sstream>
 
 namespace android {
 
-class VirtualCompositorWorker : public Worker {
+// Signals the fences of the virtual display once its acquire fences have.
+// There is nothing to compose, so this is only waiting, which it does as tasks
+// on the DRM event loop rather than on a thread of its own.
+class VirtualCompositorWorker {
  public:
   VirtualCompositorWorker();
-  ~VirtualCompositorWorker() override;
+  ~VirtualCompositorWorker();
 
-  int Init();
+  int Init(DrmEventListener *loop);
   void QueueComposite(hwc_display_contents_1_t *dc);
-
- protected:
-  void Routine() override;
+  void Dump(std::ostringstream *out) const;
 
  private:
   struct VirtualComposition {
@@ -44,12 +47,18 @@ class VirtualCompositorWorker : public Worker {
 
   int CreateNextTimelineFence();
   int FinishComposition(int timeline);
-  void Compose(std::unique_ptr<VirtualComposition> composition);
+  // These run on the event loop
+  void ComposeNext();
+  void WaitForAcquireFences();
 
-  std::queue<std::unique_ptr<VirtualComposition>> composite_queue_;
+  BoundedQueue<std::unique_ptr<VirtualComposition>> composite_queue_;
+  // The composition whose acquire fences are being waited for
+  std::unique_ptr<VirtualComposition> composition_;
   int timeline_fd_;
   int timeline_;
   int timeline_current_;
+
+  Executor executor_;
 };
 }
 
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-vsync-model"
+
+#include "vsyncmodel.h"
+#include "autolock.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+#include <cutils/log.h>
+
+namespace android {
+
+// Lock once the timestamps are within this fraction of a period of the fitted
+// line on average, e.g. 260us at 60Hz.
+static const double kMaxLockError = 1.0 / 64;
+// While locked, anything further than this from a predicted vsync is an
+// outlier
+static const double kMaxSampleError = 1.0 / 8;
+// A fit this far from the nominal period means the samples were numbered
+// wrong, or the mode isn't what we think it is.
+static const double kMaxPeriodDeviation = 0.05;
+// About 16s at 60Hz
+static const int kMaxGapPeriods = 1000;
+
+VSyncModel::VSyncModel()
+    : nominal_period_ns_(0),
+      locked_(false),
+      period_(0),
+      reference_ns_(0),
+      error_ns_(0),
+      consecutive_outliers_(0),
+      num_samples_(0),
+      num_outliers_(0),
+      num_resets_(0),
+      initialized_(false) {
+}
+
+VSyncModel::~VSyncModel() {
+  if (initialized_)
+    pthread_mutex_destroy(&lock_);
+}
+
+int VSyncModel::Init() {
+  int ret = pthread_mutex_init(&lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize vsync model lock %d", ret);
+    return ret;
+  }
+  initialized_ = true;
+  return 0;
+}
+
+void VSyncModel::Reset(int64_t nominal_period_ns) {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return;
+  nominal_period_ns_ = nominal_period_ns;
+  ResetLocked();
+}
+
+void VSyncModel::ResetLocked() {
+  samples_.clear();
+  locked_ = false;
+  consecutive_outliers_ = 0;
+  num_resets_++;
+}
+
+void VSyncModel::AddSample(int64_t timestamp_ns) {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return;
+
+  if (nominal_period_ns_ <= 0)
+    return;
+
+  double period = locked_ ? period_ : nominal_period_ns_;
+  if (!samples_.empty()) {
+    // The page flip and the vblank event of the same vblank, or a late one
+    if (timestamp_ns < samples_.back() + period / 2)
+      return;
+    // Numbering the vsyncs across a gap this long isn't safe anymore
+    if (timestamp_ns - samples_.back() > period * kMaxGapPeriods)
+      ResetLocked();
+  }
+  num_samples_++;
+
+  if (locked_) {
+    double n = round((timestamp_ns - reference_ns_) / period_);
+    double error = timestamp_ns - (reference_ns_ + n * period_);
+    if (fabs(error) > period_ * kMaxSampleError) {
+      num_outliers_++;
+      if (++consecutive_outliers_ >= kMaxConsecutiveOutliers) {
+        ALOGW("Vsync model lost lock, last sample off by %.0fus",
+              error / 1000);
+        ResetLocked();
+        samples_.push_back(timestamp_ns);
+      }
+      return;
+    }
+    consecutive_outliers_ = 0;
+  }
+
+  samples_.push_back(timestamp_ns);
+  if (samples_.size() > kMaxSamples)
+    samples_.pop_front();
+  FitLocked();
+}
+
+void VSyncModel::FitLocked() {
+  size_t count = samples_.size();
+  if (count < kMinSamples) {
+    locked_ = false;
+    return;
+  }
+
+  // Relative to the first sample, so the doubles don't lose the nanoseconds
+  double period = locked_ ? period_ : nominal_period_ns_;
+  int64_t first = samples_.front();
+  double index[kMaxSamples];
+  double time[kMaxSamples];
+  double mean_index = 0, mean_time = 0;
+  for (size_t i = 0; i < count; i++) {
+    time[i] = samples_[i] - first;
+    index[i] = round(time[i] / period);
+    mean_index += index[i];
+    mean_time += time[i];
+  }
+  mean_index /= count;
+  mean_time /= count;
+
+  double sxx = 0, sxy = 0;
+  for (size_t i = 0; i < count; i++) {
+    sxx += (index[i] - mean_index) * (index[i] - mean_index);
+    sxy += (index[i] - mean_index) * (time[i] - mean_time);
+  }
+  if (sxx <= 0) {
+    locked_ = false;
+    return;
+  }
+  double fitted_period = sxy / sxx;
+  double intercept = mean_time - fitted_period * mean_index;
+
+  if (fabs(fitted_period - nominal_period_ns_) >
+      nominal_period_ns_ * kMaxPeriodDeviation) {
+    ALOGW("Vsync period fit %.0fns too far from nominal %" PRId64 "ns",
+          fitted_period, nominal_period_ns_);
+    int64_t last = samples_.back();
+    ResetLocked();
+    samples_.push_back(last);
+    return;
+  }
+
+  double squared_error = 0;
+  for (size_t i = 0; i < count; i++) {
+    double error = time[i] - (intercept + fitted_period * index[i]);
+    squared_error += error * error;
+  }
+
+  period_ = fitted_period;
+  reference_ns_ = first + intercept;
+  error_ns_ = sqrt(squared_error / count);
+  locked_ = error_ns_ < fitted_period * kMaxLockError;
+}
+
+bool VSyncModel::locked() const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return false;
+  return locked_;
+}
+
+int64_t VSyncModel::period_ns() const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return 0;
+  return locked_ ? llround(period_) : nominal_period_ns_;
+}
+
+bool VSyncModel::PredictLocked(int64_t after_ns, int64_t *vsync_ns) const {
+  if (!locked_)
+    return false;
+  double n = ceil((after_ns - reference_ns_) / period_);
+  *vsync_ns = llround(reference_ns_ + n * period_);
+  // Rounding can land a hair before |after_ns|
+  if (*vsync_ns < after_ns)
+    *vsync_ns = llround(reference_ns_ + (n + 1) * period_);
+  return true;
+}
+
+bool VSyncModel::PredictNext(int64_t after_ns, int64_t *vsync_ns) const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return false;
+  return PredictLocked(after_ns, vsync_ns);
+}
+
+void VSyncModel::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return;
+
+  *out << "locked=" << locked_ << " nominal_period_ns=" << nominal_period_ns_;
+  if (locked_)
+    *out << " period_ns=" << llround(period_)
+         << " refresh_millihz=" << llround(1e12 / period_)
+         << " error_us=" << llround(error_ns_ / 1000);
+  *out << " samples=" << num_samples_ << " outliers=" << num_outliers_
+       << " resets=" << num_resets_;
+}
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VSYNC_MODEL_H_
+#define ANDROID_VSYNC_MODEL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <sstream>
+
+namespace android {
+
+// Fits the period and phase of a display's vsync to the timestamps of its
+// recent hardware vblanks, so that vsyncs can be predicted rather than waited
+// for.
+//
+// Each timestamp is numbered by the vsync it belongs to, counting the ones
+// that weren't sampled, and a least squares line through them gives the
+// period and phase. The model is locked once the timestamps stick close
+// enough to that line. While locked, a timestamp that's too far off the
+// predicted vsync is thrown away as an outlier; several in a row mean the
+// timing really changed and the model starts over.
+class VSyncModel {
+ public:
+  VSyncModel();
+  ~VSyncModel();
+
+  int Init();
+
+  // Starts over for a mode with the given nominal period, 0 if unknown
+  void Reset(int64_t nominal_period_ns);
+
+  // Adds the CLOCK_MONOTONIC timestamp of a hardware vblank. Samples of the
+  // same vblank from different sources only count once.
+  void AddSample(int64_t timestamp_ns);
+
+  bool locked() const;
+  // The fitted period while locked, otherwise the nominal one
+  int64_t period_ns() const;
+  // Sets |vsync_ns| to the first predicted vsync at or after |after_ns|.
+  // Returns false unless locked.
+  bool PredictNext(int64_t after_ns, int64_t *vsync_ns) const;
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  // About a second at 60Hz. More samples reach further back, which pins
+  // down the period better but reacts slower to drift.
+  static const size_t kMaxSamples = 64;
+  static const size_t kMinSamples = 6;
+  static const int kMaxConsecutiveOutliers = 3;
+
+  // Must be called with lock_ held
+  void ResetLocked();
+  void FitLocked();
+  bool PredictLocked(int64_t after_ns, int64_t *vsync_ns) const;
+
+  int64_t nominal_period_ns_;
+  std::deque<int64_t> samples_;
+
+  // Valid while locked_, the fitted vsync n is at reference_ns_ + n * period_
+  bool locked_;
+  double period_;
+  double reference_ns_;
+  double error_ns_;
+  int consecutive_outliers_;
+
+  uint64_t num_samples_;
+  uint64_t num_outliers_;
+  uint64_t num_resets_;
+
+  bool initialized_;
+  mutable pthread_mutex_t lock_;
+};
+}
+
+#endif  // ANDROID_VSYNC_MODEL_H_
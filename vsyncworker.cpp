@@ -16,74 +16,142 @@
 
 #define LOG_TAG "hwc-vsync-worker"
 
-#include "drmresources.h"
 #include "vsyncworker.h"
-#include "worker.h"
+#include "autolock.h"
+#include "drmeventlistener.h"
+#include "drmresources.h"
 
-#include <map>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <algorithm>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 
 namespace android {
 
+static const int64_t kOneSecondNs = 1 * 1000 * 1000 * 1000;
+
+// Guards VBlankHandler::worker_, which is cleared when the worker goes away
+// while its event is still on the way.
+static pthread_mutex_t g_vblank_lock = PTHREAD_MUTEX_INITIALIZER;
+
+class VSyncWorker::VBlankHandler : public DrmEventHandler {
+ public:
+  VBlankHandler(VSyncWorker *worker) : worker_(worker) {
+  }
+
+  void HandleEvent(uint64_t timestamp_us) override {
+    pthread_mutex_lock(&g_vblank_lock);
+    if (worker_)
+      worker_->HandleVBlank(timestamp_us * 1000);
+    pthread_mutex_unlock(&g_vblank_lock);
+  }
+
+  VSyncWorker *worker_;
+};
+
+static int64_t Now() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * kOneSecondNs + ts.tv_nsec;
+}
+
 VSyncWorker::VSyncWorker()
-    : Worker("vsync", HAL_PRIORITY_URGENT_DISPLAY),
-      drm_(NULL),
+    : drm_(NULL),
       procs_(NULL),
+      model_(NULL),
+      resync_interval_ns_(0),
+      sf_phase_ns_(0),
       display_(-1),
-      last_timestamp_(-1) {
+      enabled_(false),
+      last_timestamp_(-1),
+      last_vblank_ns_(0),
+      pending_vblank_(NULL),
+      vblank_delivers_(false),
+      synthetic_pending_(false),
+      generation_(0),
+      num_vblanks_(0),
+      num_synthetic_(0),
+      initialized_(false) {
 }
 
 VSyncWorker::~VSyncWorker() {
+  if (!initialized_)
+    return;
+
+  executor_.Exit();
+
+  pthread_mutex_lock(&g_vblank_lock);
+  pthread_mutex_lock(&lock_);
+  if (pending_vblank_)
+    pending_vblank_->worker_ = NULL;
+  pthread_mutex_unlock(&lock_);
+  pthread_mutex_unlock(&g_vblank_lock);
+
+  pthread_mutex_destroy(&lock_);
 }
 
 int VSyncWorker::Init(DrmResources *drm, int display) {
   drm_ = drm;
   display_ = display;
+  model_ = drm->compositor()->GetVSyncModel(display);
 
-  return InitWorker();
-}
+  char value[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.vsync_resync_ms", value, "0");
+  resync_interval_ns_ = atoll(value) * 1000 * 1000;
+  char key[PROPERTY_KEY_MAX];
+  snprintf(key, sizeof(key), "hwc.drm.display%d.sf_phase_us", display);
+  property_get(key, value, "0");
+  sf_phase_ns_ = atoll(value) * 1000;
 
-int VSyncWorker::SetProcs(hwc_procs_t const *procs) {
-  int ret = Lock();
+  int ret = pthread_mutex_init(&lock_, NULL);
   if (ret) {
-    ALOGE("Failed to lock vsync worker lock %d\n", ret);
+    ALOGE("Failed to initialize vsync worker lock %d", ret);
     return ret;
   }
+  initialized_ = true;
 
-  procs_ = procs;
+  return executor_.Init(drm->event_listener());
+}
 
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock vsync worker lock %d\n", ret);
+int VSyncWorker::SetProcs(hwc_procs_t const *procs) {
+  AutoLock lock(&lock_, "vsync");
+  int ret = lock.Lock();
+  if (ret)
     return ret;
-  }
+
+  procs_ = procs;
   return 0;
 }
 
 int VSyncWorker::VSyncControl(bool enabled) {
-  int ret = Lock();
-  if (ret) {
-    ALOGE("Failed to lock vsync worker lock %d\n", ret);
+  AutoLock lock(&lock_, "vsync");
+  int ret = lock.Lock();
+  if (ret)
     return ret;
-  }
 
-  enabled_ = enabled;
   last_timestamp_ = -1;
-  int signal_ret = SignalLocked();
+  if (enabled == enabled_)
+    return 0;
+  enabled_ = enabled;
 
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock vsync worker lock %d\n", ret);
-    return ret;
+  if (enabled) {
+    RequestVSyncLocked();
+  } else {
+    // A vblank event that is already requested can't be taken back, it's
+    // dropped when it arrives.
+    generation_++;
+    synthetic_pending_ = false;
   }
-
-  return signal_ret;
+  return 0;
 }
 
 /*
@@ -107,97 +175,151 @@ int64_t VSyncWorker::GetPhasedVSync(int64_t frame_ns, int64_t current) {
          last_timestamp_;
 }
 
-static const int64_t kOneSecondNs = 1 * 1000 * 1000 * 1000;
-
-int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
-  struct timespec vsync;
-  int ret = clock_gettime(CLOCK_MONOTONIC, &vsync);
-
-  float refresh = 60.0f;  // Default to 60Hz refresh rate
+int64_t VSyncWorker::GetFramePeriodNs() {
   DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
-  if (conn && conn->active_mode().v_refresh() != 0.0f)
-    refresh = conn->active_mode().v_refresh();
-  else
-    ALOGW("Vsync worker active with conn=%p refresh=%f\n", conn,
-          conn ? conn->active_mode().v_refresh() : 0.0f);
-
-  int64_t phased_timestamp = GetPhasedVSync(
-      kOneSecondNs / refresh, vsync.tv_sec * kOneSecondNs + vsync.tv_nsec);
-  vsync.tv_sec = phased_timestamp / kOneSecondNs;
-  vsync.tv_nsec = phased_timestamp - (vsync.tv_sec * kOneSecondNs);
-  do {
-    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &vsync, NULL);
-  } while (ret == -1 && errno == EINTR);
-  if (ret)
-    return ret;
+  int64_t period_ns = conn ? conn->active_mode().frame_period_ns() : 0;
+  if (period_ns > 0)
+    return period_ns;
 
-  *timestamp = (int64_t)vsync.tv_sec * kOneSecondNs + (int64_t)vsync.tv_nsec;
-  return 0;
+  ALOGW("Vsync worker active with conn=%p, using 60Hz", conn);
+  return kOneSecondNs / 60;
 }
 
-void VSyncWorker::Routine() {
-  int ret = Lock();
-  if (ret) {
-    ALOGE("Failed to lock worker %d", ret);
+void VSyncWorker::RequestVSyncLocked() {
+  if (synthetic_pending_ || (pending_vblank_ && vblank_delivers_))
     return;
-  }
 
-  if (!enabled_) {
-    ret = WaitForSignalOrExitLocked();
-    if (ret == -EINTR) {
-      return;
-    }
-  }
-
-  bool enabled = enabled_;
-  int display = display_;
-  hwc_procs_t const *procs = procs_;
-
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock worker %d", ret);
-  }
-
-  if (!enabled)
+  bool resync_due = !resync_interval_ns_ ||
+                    Now() - last_vblank_ns_ >= resync_interval_ns_;
+  // Off a phase, or between resyncs, the vsync comes from the model and a
+  // hardware vblank only keeps the model honest.
+  if (model_ && model_->locked() && (sf_phase_ns_ || !resync_due)) {
+    ScheduleSyntheticVSyncLocked();
+    if (resync_due && !pending_vblank_)
+      RequestVBlankLocked(false);
     return;
+  }
 
-  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display);
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display");
+  if (pending_vblank_) {
+    vblank_delivers_ = true;
     return;
   }
+  if (RequestVBlankLocked(true))
+    ScheduleSyntheticVSyncLocked();
+}
+
+int VSyncWorker::RequestVBlankLocked(bool deliver) {
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display_);
+  if (!crtc)
+    return -ENODEV;
   uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
 
+  VBlankHandler *handler = new VBlankHandler(this);
   drmVBlank vblank;
   memset(&vblank, 0, sizeof(vblank));
-  vblank.request.type = (drmVBlankSeqType)(
-      DRM_VBLANK_RELATIVE | (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
+  vblank.request.type =
+      (drmVBlankSeqType)(DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+                         (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
   vblank.request.sequence = 1;
+  vblank.request.signal = (unsigned long)handler;
+
+  int ret = drmWaitVBlank(drm_->fd(), &vblank);
+  if (ret) {
+    delete handler;
+    return ret;
+  }
+  pending_vblank_ = handler;
+  vblank_delivers_ = deliver;
+  return 0;
+}
 
+void VSyncWorker::ScheduleSyntheticVSyncLocked() {
+  int64_t now = Now();
   int64_t timestamp;
-  ret = drmWaitVBlank(drm_->fd(), &vblank);
-  if (ret == -EINTR) {
-    return;
-  } else if (ret) {
-    ret = SyntheticWaitVBlank(&timestamp);
-    if (ret)
-      return;
+  int64_t deliver_at;
+  // The first vblank whose phased delivery is still ahead, but not the one
+  // that was just delivered again
+  int64_t after = now - sf_phase_ns_;
+  if (model_ && last_timestamp_ >= 0)
+    after = std::max(after, last_timestamp_ + model_->period_ns() / 2);
+  if (model_ && model_->PredictNext(after, &timestamp)) {
+    deliver_at = timestamp + sf_phase_ns_;
   } else {
-    timestamp = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
-                (int64_t)vblank.reply.tval_usec * 1000;
+    timestamp = GetPhasedVSync(GetFramePeriodNs(), now);
+    deliver_at = timestamp;
   }
+  uint64_t generation = generation_;
+  int ret = executor_.PostDelayed(deliver_at - now, [this, generation,
+                                                     timestamp]() {
+    HandleSyntheticVSync(generation, timestamp);
+  });
+  if (ret) {
+    ALOGE("Failed to schedule synthetic vsync %d", ret);
+    return;
+  }
+  synthetic_pending_ = true;
+}
 
-  /*
-   * There's a race here where a change in procs_ will not take effect until
-   * the next subsequent requested vsync. This is unavoidable since we can't
-   * call the vsync hook while holding the thread lock.
-   *
-   * We could shorten the race window by caching procs_ right before calling
-   * the hook. However, in practice, procs_ is only updated once, so it's not
-   * worth the overhead.
-   */
-  if (procs && procs->vsync)
-    procs->vsync(procs, display, timestamp);
+void VSyncWorker::HandleVBlank(int64_t timestamp) {
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+
+  pending_vblank_ = NULL;
+  last_vblank_ns_ = timestamp;
+  num_vblanks_++;
+  if (model_)
+    model_->AddSample(timestamp);
+  if (!enabled_ || !vblank_delivers_)
+    return;
+  last_timestamp_ = timestamp;
+  hwc_procs_t const *procs = procs_;
+  lock.Unlock();
+
+  DeliverVSync(procs, timestamp);
+}
+
+void VSyncWorker::HandleSyntheticVSync(uint64_t generation,
+                                       int64_t timestamp) {
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+
+  if (generation != generation_)
+    return;
+  synthetic_pending_ = false;
+  if (!enabled_)
+    return;
   last_timestamp_ = timestamp;
+  num_synthetic_++;
+  hwc_procs_t const *procs = procs_;
+  lock.Unlock();
+
+  DeliverVSync(procs, timestamp);
+}
+
+// SurfaceFlinger hears about the vsync before the next one is requested, the
+// ioctl would only add to its latency.
+void VSyncWorker::DeliverVSync(hwc_procs_t const *procs, int64_t timestamp) {
+  if (procs && procs->vsync)
+    procs->vsync(procs, display_, timestamp);
+
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+  if (enabled_)
+    RequestVSyncLocked();
+}
+
+void VSyncWorker::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+
+  *out << "VSync display " << display_ << ": enabled=" << enabled_
+       << " sf_phase_us=" << sf_phase_ns_ / 1000
+       << " resync_ms=" << resync_interval_ns_ / (1000 * 1000)
+       << " vblanks=" << num_vblanks_ << " synthetic=" << num_synthetic_
+       << "\n";
 }
 }
@@ -18,39 +18,93 @@
 #define ANDROID_EVENT_WORKER_H_
 
 #include "drmresources.h"
-#include "worker.h"
+#include "executor.h"
+#include "vsyncmodel.h"
 
-#include <map>
+#include <pthread.h>
 #include <stdint.h>
+#include <sstream>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
 namespace android {
 
-class VSyncWorker : public Worker {
+// Delivers vsync to SurfaceFlinger. The vblanks are requested as DRM events,
+// so all displays are served by the DRM event loop rather than a thread each
+// blocking in drmWaitVBlank(). When the CRTC can't provide vblanks, e.g.
+// while it's off, the vsyncs are made up with a timer on the mode's frame
+// period, in phase with the last real one.
+//
+// Once the display's VSyncModel has locked on, hardware vblanks can be made
+// rare (hwc.drm.vsync_resync_ms): the vsyncs in between are predicted by the
+// model, and the kernel can turn the vblank interrupt off meanwhile.
+//
+// SurfaceFlinger can also be woken ahead of or behind the vblank
+// (hwc.drm.displayN.sf_phase_us). That too takes a locked model, each vsync
+// is delivered at its predicted vblank plus the phase. The timestamp handed
+// over stays that of the vblank, so SurfaceFlinger's own vsync model and its
+// present fences still agree.
+class VSyncWorker {
  public:
   VSyncWorker();
-  ~VSyncWorker() override;
+  ~VSyncWorker();
 
   int Init(DrmResources *drm, int display);
   int SetProcs(hwc_procs_t const *procs);
 
   int VSyncControl(bool enabled);
 
- protected:
-  void Routine() override;
+  void Dump(std::ostringstream *out) const;
 
  private:
+  class VBlankHandler;
+
+  // Must be called with lock_ held
+  void RequestVSyncLocked();
+  // |deliver| is false for a vblank that only feeds the model
+  int RequestVBlankLocked(bool deliver);
+  void ScheduleSyntheticVSyncLocked();
+
+  // These run on the event loop
+  void HandleVBlank(int64_t timestamp);
+  void HandleSyntheticVSync(uint64_t generation, int64_t timestamp);
+  void DeliverVSync(hwc_procs_t const *procs, int64_t timestamp);
+
   int64_t GetPhasedVSync(int64_t frame_ns, int64_t current);
-  int SyntheticWaitVBlank(int64_t *timestamp);
+  int64_t GetFramePeriodNs();
 
   DrmResources *drm_;
   hwc_procs_t const *procs_;
+  VSyncModel *model_;
+  // How often to check on a locked model with a hardware vblank, 0 to use
+  // hardware vblanks throughout.
+  int64_t resync_interval_ns_;
+  // When to signal SurfaceFlinger relative to the vblank, negative is before
+  int64_t sf_phase_ns_;
 
   int display_;
   bool enabled_;
   int64_t last_timestamp_;
+  int64_t last_vblank_ns_;
+
+  // The vblank event requested from the kernel and not delivered yet. It
+  // belongs to the DRM fd, which deletes it once it arrives.
+  VBlankHandler *pending_vblank_;
+  // Whether pending_vblank_ is delivered to SurfaceFlinger when it arrives
+  bool vblank_delivers_;
+  bool synthetic_pending_;
+  // Bumped when vsync is turned off, so synthetic vsyncs that were already
+  // scheduled are dropped.
+  uint64_t generation_;
+
+  uint64_t num_vblanks_;
+  uint64_t num_synthetic_;
+
+  bool initialized_;
+  mutable pthread_mutex_t lock_;
+
+  Executor executor_;
 };
 }
 
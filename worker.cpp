@@ -19,26 +19,107 @@
 #include "worker.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/resource.h>
 #include <sys/signal.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 namespace android {
 
 static const int64_t kBillion = 1000000000LL;
 
+// Not in older uapi headers
+#ifndef SCHED_FLAG_UTIL_CLAMP_MIN
+#define SCHED_FLAG_KEEP_POLICY 0x08
+#define SCHED_FLAG_KEEP_PARAMS 0x10
+#define SCHED_FLAG_UTIL_CLAMP_MIN 0x20
+#endif
+
+struct SchedAttr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+  uint32_t sched_util_min;
+  uint32_t sched_util_max;
+};
+
+static pthread_mutex_t g_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<Worker *> g_workers;
+
+static int64_t Now() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * kBillion + ts.tv_nsec;
+}
+
+// The settings are lists of <worker name>=<value> separated by commas, e.g.
+// hwc.drm.sched.fifo=frame-worker=2,drm-event-listener=3. A "*" entry
+// applies to the workers that aren't listed. Properties are per setting
+// rather than per worker because keys are limited to 31 characters.
+static bool GetSchedSetting(const char *property, const std::string &name,
+                            std::string *value) {
+  char list[PROPERTY_VALUE_MAX];
+  property_get(property, list, "");
+
+  bool found = false;
+  char *save = NULL;
+  for (char *entry = strtok_r(list, ",", &save); entry;
+       entry = strtok_r(NULL, ",", &save)) {
+    char *separator = strchr(entry, '=');
+    if (!separator)
+      continue;
+    *separator = '\0';
+    if (name == entry) {
+      *value = separator + 1;
+      return true;
+    }
+    if (!strcmp(entry, "*")) {
+      *value = separator + 1;
+      found = true;
+    }
+  }
+  return found;
+}
+
 Worker::Worker(const char *name, int priority)
-    : name_(name), priority_(priority), exit_(false), initialized_(false) {
+    : name_(name),
+      priority_(priority),
+      exit_(false),
+      initialized_(false),
+      idle_(false),
+      signal_time_ns_(0),
+      num_wakeups_(0),
+      total_wakeup_latency_ns_(0),
+      max_wakeup_latency_ns_(0) {
 }
 
 Worker::~Worker() {
   if (!initialized_)
     return;
 
+  pthread_mutex_lock(&g_workers_lock);
+  g_workers.erase(std::find(g_workers.begin(), g_workers.end(), this));
+  pthread_mutex_unlock(&g_workers_lock);
+
   pthread_kill(thread_, SIGTERM);
   pthread_cond_destroy(&cond_);
   pthread_mutex_destroy(&lock_);
@@ -69,6 +150,10 @@ int Worker::InitWorker() {
     return ret;
   }
   initialized_ = true;
+
+  pthread_mutex_lock(&g_workers_lock);
+  g_workers.push_back(this);
+  pthread_mutex_unlock(&g_workers_lock);
   return 0;
 }
 
@@ -89,13 +174,21 @@ int Worker::SignalLocked() {
 }
 
 int Worker::ExitLocked() {
+  // Someone else is already joining the thread, or has joined it
+  if (exit_)
+    return 0;
+
   int signal_ret = SignalThreadLocked(true);
   if (signal_ret)
     ALOGE("Failed to signal thread %s with exit %d", name_.c_str(), signal_ret);
 
+  // The thread has to get the lock to see exit_, so it can't be held while
+  // joining.
+  Unlock();
   int join_ret = pthread_join(thread_, NULL);
   if (join_ret && join_ret != ESRCH)
     ALOGE("Failed to join thread %s in exit %d", name_.c_str(), join_ret);
+  Lock();
 
   return signal_ret | join_ret;
 }
@@ -118,6 +211,10 @@ int Worker::Signal() {
 }
 
 int Worker::Exit() {
+  // Never started, there's no thread and no lock
+  if (!initialized_)
+    return 0;
+
   int ret = Lock();
   if (ret) {
     ALOGE("Failed to acquire lock in Exit() %d\n", ret);
@@ -138,7 +235,12 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
   if (exit_)
     return -EINTR;
 
+  // Signals that came while the thread was busy don't count, it wasn't
+  // waiting for them.
+  signal_time_ns_ = 0;
+
   int ret = 0;
+  int64_t deadline_ns = 0;
   if (max_nanoseconds < 0) {
     ret = pthread_cond_wait(&cond_, &lock_);
   } else {
@@ -149,22 +251,56 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
     int64_t nanos = (int64_t)abs_deadline.tv_nsec + max_nanoseconds;
     abs_deadline.tv_sec += nanos / kBillion;
     abs_deadline.tv_nsec = nanos % kBillion;
+    deadline_ns = abs_deadline.tv_sec * kBillion + abs_deadline.tv_nsec;
     ret = pthread_cond_timedwait(&cond_, &lock_, &abs_deadline);
     if (ret == ETIMEDOUT)
       ret = -ETIMEDOUT;
   }
 
+  if (!ret && signal_time_ns_)
+    RecordWakeupLocked(signal_time_ns_);
+  else if (ret == -ETIMEDOUT)
+    RecordWakeupLocked(deadline_ns);
+
   if (exit_)
     return -EINTR;
 
   return ret;
 }
 
+void Worker::RecordWakeupLocked(int64_t expected_ns) {
+  int64_t latency_ns = std::max(Now() - expected_ns, (int64_t)0);
+  num_wakeups_++;
+  total_wakeup_latency_ns_ += latency_ns;
+  max_wakeup_latency_ns_ = std::max(max_wakeup_latency_ns_, latency_ns);
+}
+
+int Worker::SignalIfIdle() {
+  // Sequentially consistent, pairs with the store in WaitForWorkOrExitLocked()
+  // and whatever store published the work.
+  if (!idle_.load())
+    return 0;
+  return Signal();
+}
+
+int Worker::WaitForWorkOrExitLocked(const std::function<bool()> &has_work,
+                                    int64_t max_nanoseconds) {
+  idle_.store(true);
+  int ret = 0;
+  if (!has_work())
+    ret = WaitForSignalOrExitLocked(max_nanoseconds);
+  else if (exit_)
+    ret = -EINTR;
+  idle_.store(false);
+  return ret;
+}
+
 // static
 void *Worker::InternalRoutine(void *arg) {
   Worker *worker = (Worker *)arg;
 
   setpriority(PRIO_PROCESS, 0, worker->priority_);
+  worker->ApplySchedulingPolicy();
 
   while (true) {
     int ret = worker->Lock();
@@ -185,12 +321,15 @@ void *Worker::InternalRoutine(void *arg) {
 
     worker->Routine();
   }
+  worker->Exiting();
   return NULL;
 }
 
 int Worker::SignalThreadLocked(bool exit) {
   if (exit)
     exit_ = exit;
+  if (!signal_time_ns_)
+    signal_time_ns_ = Now();
 
   int ret = pthread_cond_signal(&cond_);
   if (ret) {
@@ -198,6 +337,114 @@ int Worker::SignalThreadLocked(bool exit) {
     return ret;
   }
 
+  Interrupt();
   return 0;
 }
+
+static int SetUtilClampMin(int util_min) {
+#ifdef __NR_sched_setattr
+  struct SchedAttr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.sched_flags = SCHED_FLAG_KEEP_POLICY | SCHED_FLAG_KEEP_PARAMS |
+                     SCHED_FLAG_UTIL_CLAMP_MIN;
+  attr.sched_util_min = util_min;
+  if (syscall(__NR_sched_setattr, 0, &attr, 0))
+    return -errno;
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+static int JoinCpuset(const char *cpuset) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/dev/cpuset/%s/tasks", cpuset);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  char tid[16];
+  int len = snprintf(tid, sizeof(tid), "%d", gettid());
+  int ret = write(fd, tid, len) == len ? 0 : -errno;
+  close(fd);
+  return ret;
+}
+
+// Runs on the worker's own thread, the settings only apply to the caller.
+// Anything that fails is logged and left at the default.
+void Worker::ApplySchedulingPolicy() {
+  std::ostringstream policy;
+  policy << "nice=" << priority_;
+  std::string value;
+
+  if (GetSchedSetting("hwc.drm.sched.cpuset", name_, &value)) {
+    int ret = JoinCpuset(value.c_str());
+    if (ret)
+      ALOGE("Failed to move %s thread to cpuset %s %d", name_.c_str(),
+            value.c_str(), ret);
+    else
+      policy << " cpuset=" << value;
+  }
+
+  // After the cpuset, which resets the affinity
+  if (GetSchedSetting("hwc.drm.sched.cpus", name_, &value)) {
+    unsigned long long mask = strtoull(value.c_str(), NULL, 16);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64; cpu++)
+      if (mask & (1ULL << cpu))
+        CPU_SET(cpu, &cpus);
+    if (!mask || sched_setaffinity(0, sizeof(cpus), &cpus))
+      ALOGE("Failed to set %s thread affinity to %s %d", name_.c_str(),
+            value.c_str(), mask ? -errno : -EINVAL);
+    else
+      policy << " cpus=" << std::hex << mask << std::dec;
+  }
+
+  if (GetSchedSetting("hwc.drm.sched.fifo", name_, &value)) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = atoi(value.c_str());
+    if (sched_setscheduler(0, SCHED_FIFO, &param))
+      ALOGE("Failed to set %s thread to SCHED_FIFO %d %d", name_.c_str(),
+            param.sched_priority, -errno);
+    else
+      policy << " fifo=" << param.sched_priority;
+  }
+
+  if (GetSchedSetting("hwc.drm.sched.uclamp", name_, &value)) {
+    int util_min = atoi(value.c_str());
+    int ret = SetUtilClampMin(util_min);
+    if (ret)
+      ALOGE("Failed to set %s thread uclamp.min to %d %d", name_.c_str(),
+            util_min, ret);
+    else
+      policy << " uclamp_min=" << util_min;
+  }
+
+  if (Lock())
+    return;
+  sched_policy_ = policy.str();
+  Unlock();
+}
+
+// static
+void Worker::DumpAll(std::ostringstream *out) {
+  *out << "Worker threads:\n";
+  pthread_mutex_lock(&g_workers_lock);
+  for (Worker *worker : g_workers) {
+    if (worker->Lock())
+      continue;
+    *out << "  " << worker->name_ << ": " << worker->sched_policy_
+         << " wakeups=" << worker->num_wakeups_;
+    if (worker->num_wakeups_)
+      *out << " avg_latency_us="
+           << worker->total_wakeup_latency_ns_ / worker->num_wakeups_ / 1000
+           << " max_latency_us=" << worker->max_wakeup_latency_ns_ / 1000;
+    *out << "\n";
+    worker->Unlock();
+  }
+  pthread_mutex_unlock(&g_workers_lock);
+}
 }
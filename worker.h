@@ -19,6 +19,9 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <sstream>
 #include <string>
 
 namespace android {
@@ -28,7 +31,8 @@ class Worker {
   int Lock();
   int Unlock();
 
-  // Must be called with the lock acquired
+  // Must be called with the lock acquired. ExitLocked() releases it while it
+  // waits for the thread to finish.
   int SignalLocked();
   int ExitLocked();
 
@@ -36,6 +40,14 @@ class Worker {
   int Signal();
   int Exit();
 
+  // Wakes the thread if it is sleeping in WaitForWorkOrExitLocked(). Meant for
+  // producers of lock-free queues: the lock is only taken when the thread is
+  // actually idle, not for every item.
+  int SignalIfIdle();
+
+  // Scheduling setup and wakeup latency of all worker threads
+  static void DumpAll(std::ostringstream *out);
+
  protected:
   Worker(const char *name, int priority);
   virtual ~Worker();
@@ -46,6 +58,16 @@ class Worker {
 
   virtual void Routine() = 0;
 
+  // Called on the thread once it is done, to release what is bound to it
+  virtual void Exiting() {
+  }
+
+  // Called with the lock held whenever the thread is signaled or asked to
+  // exit. Workers that sleep in something other than
+  // WaitForSignalOrExitLocked(), such as a poll loop, wake up from it here.
+  virtual void Interrupt() {
+  }
+
   /*
    * Must be called with the lock acquired. max_nanoseconds may be negative to
    * indicate infinite timeout, otherwise it indicates the maximum time span to
@@ -54,9 +76,22 @@ class Worker {
    */
   int WaitForSignalOrExitLocked(int64_t max_nanoseconds = -1);
 
+  /*
+   * Like WaitForSignalOrExitLocked(), but returns right away if has_work()
+   * is true once the thread has been marked idle. Producers that publish work
+   * before calling SignalIfIdle() are therefore never missed.
+   */
+  int WaitForWorkOrExitLocked(const std::function<bool()> &has_work,
+                              int64_t max_nanoseconds = -1);
+
  private:
   static void *InternalRoutine(void *worker);
 
+  // Applies the hwc.drm.sched.* properties to the calling thread
+  void ApplySchedulingPolicy();
+  // Must be called with the lock acquired
+  void RecordWakeupLocked(int64_t expected_ns);
+
   // Must be called with the lock acquired
   int SignalThreadLocked(bool exit);
 
@@ -69,6 +104,18 @@ class Worker {
 
   bool exit_;
   bool initialized_;
+
+  std::atomic<bool> idle_;
+
+  // What ApplySchedulingPolicy() managed to set, for dumps
+  std::string sched_policy_;
+  // Time of the first signal since the thread went to sleep, 0 if none
+  int64_t signal_time_ns_;
+  // How long after being signaled, or after its timeout expired, the thread
+  // got to run again
+  uint64_t num_wakeups_;
+  int64_t total_wakeup_latency_ns_;
+  int64_t max_wakeup_latency_ns_;
 };
 }
 